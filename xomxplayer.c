@@ -7,7 +7,7 @@
  * It is assumed that if no events are received in 500ms, that is the end of the move / resize.
  * If it is the first timeout since the events were received (evc>0) move omxplayer overlay to the current xwindow position
  *
- * gcc -Wall xomxplayer.c -o xomxplayer -lX11
+ * gcc -Wall xomxplayer.c -o xomxplayer -lX11 -lXext -lpthread
  * ChangeLog:
  *    21-01-2017: Added scale factor based on the size of the frame buffer.
  *                Set XOMX_FB_DEV to the frame buffer device to enable. This is required if using the framebuffer at resolutions other then 1920x1080,
@@ -22,280 +22,5558 @@
  *                so didn't trigger if omxplayer was terminated by a signal.
  *                If video is searched forwards past then end of the file, omxplayer no longer responds to dbus control
  *                Wait for omxplayer to finish at the end, and if it doesn't return within 3 seconds send SIGTERM, then SIGKILL.
+ *    18-10-2026: Added geometry snapping (XOMX_SNAP, off by default). The source size is read from the mp4 header (probeFile()) and the window manager
+ *                is asked for sizes that are whole multiples of 1/XOMX_SNAP of the source, with the source aspect ratio. The GPU then scales
+ *                by simple ratios (e.g. 1/2, 3/4) rather than odd fractions. VideoPos is rounded the same way, centred in the window,
+ *                for window managers which ignore the size hints.
+ *                Added hideOnMove: the video is hidden at the start of a move / resize and shown again once it has been moved
+ *                to the final position, for GPUs which tear or stall when the overlay is dragged.
+ *                dbus commands are timed from spawn to omxplayer's reply (dbus-send --print-reply, cmdStart() / cmdDone()). An EWMA and 90th percentile estimate per
+ *                command are kept, and a command is not sent again while the last one is running or less than its p90 time ago:
+ *                VideoPos is retried shortly afterwards, keys are queued until omxplayer can take them (auto repeated seeks once).
+ *                The estimates are saved per hardware model in ~/.cache/xomxplayer/cmdstats so they apply from the first command.
+ *                Added autoBuffer (off by default): omxplayer's --video_queue, --video_fifo, --audio_fifo and --threshold are chosen from the file bitrate
+ *                and the read throughput of the mount it is on (measured once in the background and cached in
+ *                ~/.cache/xomxplayer/throughput). The choice and how playback ended are appended to ~/.cache/xomxplayer/tuning.log.
+ *                Probe results are kept in ~/.cache/xomxplayer/metadata, keyed by path, size and mtime. "xomxplayer -i <dir>..."
+ *                indexes a library into it in the background: probe threads at idle I/O priority, resumable, and files that are
+ *                unchanged since the last run are skipped.
+ *                The window is created with no background, so the X server doesn't paint it on expose / resize (the overlay covers
+ *                it anyway), and with _NET_WM_BYPASS_COMPOSITOR and _NET_WM_OPAQUE_REGION so a compositing manager doesn't blend it.
+ *                overrideRedirect=1 bypasses the window manager altogether (fixed kiosk layouts); fullscreen is then done by
+ *                resizing to the screen.
+ *                Window position is tracked relative to the root window under reparenting window managers (trackGeometry()): the frame
+ *                is followed with its own ConfigureNotify, synthetic (ICCCM) ConfigureNotify is taken as root relative, and
+ *                _NET_FRAME_EXTENTS gives the offset in the frame. XTranslateCoordinates is only called on ReparentNotify.
+ *                Seek keys prefetch their target: the keyframe before it is found from the mp4 sample tables (stts, stss, stsc,
+ *                stco / co64), about two seconds from there are read in with POSIX_FADV_WILLNEED, and the seek is sent once they are
+ *                resident or after seekPrefetchMs.
+ *                Added renditionSwitch: other encodings named <name>.<height>p.<ext> next to the file are found and, when the window
+ *                settles, omxplayer is restarted at the same position on the smallest one which isn't scaled up (with hysteresis).
+ *                Off by default, as the restart is a visible gap.
+ *                Poster frame: <name>.ppm next to the file is shown in the window (MIT-SHM) until omxplayer answers on dbus. It is
+ *                scaled once per window size and the pixels of the last size cached in ~/.cache/xomxplayer/posters, so later starts only copy them.
+ *                (make one with e.g. ffmpeg -ss 10 -i film.mp4 -frames:v 1 film.ppm)
+ *                Several files may be given; they are played in turn in the same window. The next stageAhead of them are copied into
+ *                sealed memfds by a background thread (within stageBudget) and omxplayer is started on the copy, so flaky or slow
+ *                storage is only read ahead of time (off by default: the copies are held in memory).
+ *                VisibilityNotify no longer hides / shows the video at once: the change is applied after visHideMs / visShowMs, and a
+ *                change which is reversed before then (e.g. a window dragged across) sends nothing.
+ *                The omxplayer command line is specialised per file: fonts and --sid only when the file can have subtitles (tracks
+ *                in the mp4, non-mp4, or a .srt), --no-osd and no subtitle options when the vc4 kms driver is loaded (no need to edit
+ *                omxplayer[] for kms any more). --aspect-mode Letterbox is always kept, as the window manager may not honour
+ *                the XOMX_SNAP aspect hint. Time to ready is logged with the options used in tuning.log.
+ *                Session snapshot (playlist, item, position, pause, window geometry, hidden state, layer) is kept in a mapped two slot
+ *                file, ~/.cache/xomxplayer/session, rewritten only when something changes. "xomxplayer --restore" puts it back after a
+ *                crash or power cut, starting omxplayer at the saved position (kept to sessionPosS; restoreFollowClock adds the time it was
+ *                down) and place while the window is created. Each wall slot
+ *                has its own file (session-slot<n>), and further windows take session.1, session.2 and so on.
+ *                The X server going away no longer ends playback: the connection is dropped, omxplayer and the playlist carry on,
+ *                and xomxplayer reconnects with backoff, making the window again at its last geometry and re-sending VideoPos.
+ *                Live upgrade: on SIGUSR2 xomxplayer re-execs its binary (a newly installed build, if there is one) and the new
+ *                process adopts the running omxplayer, so playback isn't interrupted. The window is made again in its place (the old
+ *                one, made by the old process, would no longer get the window manager's close). The gap is logged.
+ *                Metrics (off by default): command counts and latencies, spawns, child exits, player starts / kills and resource use, move and
+ *                visibility event / command counts, time hidden and shown, staging hits, are written for node-exporter's
+ *                textfile collector to metricsDir/xomxplayer-<pid>.prom every metricsMs.
+ *                Proof of play (off by default): start and end records (file, times, position reached, completion, pauses / seeks / hides, exit
+ *                status) are appended to ~/.cache/xomxplayer/playlog/ by a background thread in synced batches.
+ *                "xomxplayer --export-log [--json]" prints them as CSV or JSON lines.
+ *                Schedule: "--schedule <file>" switches between looping playlists by time of day, with breaks every so often
+ *                (format above XOMX_sched), from a timer wheel ticked by a timerfd; clock changes and DST re-anchor it. How late
+ *                each switch starts playing and the scheduling overhead are logged / exported.
+ *                Macro keys: keys[] entries can run a sequence of steps (dbus commands, full screen, set position), each started
+ *                when the last has finished. F1 plays from 10:00 full screen with sound as an example.
+ *                Wall layouts: xomxplayers started with --slot <n> are moved together to one of layouts[] by "xomxplayer --layout <n>"
+ *                or layoutKey. Each hides its video, moves and sends VideoPos at once, and shows it when all slots have moved.
+ *                Mosaic: "xomxplayer -m <file>..." plays up to 16 files tiled in one window, an omxplayer each on consecutive
+ *                layers, relaid out in one pass with every VideoPos sent together; letterboxed or cropped (mosaicCrop); tileFocusKey
+ *                moves the key focus between tiles. The window stays until every tile has finished, and --restore rebuilds the
+ *                mosaic from the session snapshot.
+ *                Audio elision: only the focused tile / wallAudioSlot is heard. Other players are muted, and after audioElideMs
+ *                restarted at their position without audio decoding (--aidx -1); audio comes back the same way once the focus has
+ *                settled (audioSettleMs), at most one restart per audioGapMs. Restarts are polled from the main loop and never wait.
+ *                Player priorities: nice, I/O priority and CPU affinity of every player thread follow visibility and mosaic focus
+ *                (playerClass[]), raised at once and lowered after prioDemoteMs. Run queue delay per class is exported. Nice is only
+ *                changed where it can be lowered again (CAP_SYS_NICE or RLIMIT_NICE); otherwise just I/O priority and CPUs.
+ *                Warm player (poolSize, off by default): the next playlist item is started ahead, transparent, silent, paused and at low I/O priority, and
+ *                claimed when the item ends (VideoPos, SetAlpha, Play), within poolMinFreeMB / poolMaxPressure of memory. A
+ *                schedule entry due within poolAheadS is warmed instead, and claimed at the switch while the old player quits.
+ *                A warm player on another file than the one wanted is switched to it with OpenUri rather than dropped.
  */
 
 // TODO: only one dbus child process should be allowed at a time, and it should be checked that this has finished before quit.
 //       present code assumes all dbus command children have finished at exit.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <X11/keysym.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <glob.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/file.h>
+
+#define LENGTH(X) (sizeof X / sizeof X[0])
+#define XOMX_FB_DEV "/dev/fb0"
+//#define XOMX_SNAP 8   /* Snap window sizes to multiples of 1/XOMX_SNAP of the source video size; uncomment to enable */
+#define DEBUG
+
+/* For framebuffer info */
+#ifdef XOMX_FB_DEV
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+#endif
+/* End of framebuffer info */
+
+/* A step of a macro: a dbus command, or an operation on the window / player */
+typedef struct {
+   const char **v;   /* Command, NULL for op */
+   int op;           /* macroFullScreen, macroSetPosition; 0 with v NULL ends the macro */
+   double arg;       /* Position in seconds for macroSetPosition */
+} XOMX_step;
+
+enum { macroFullScreen=1, macroSetPosition };
+
+typedef struct {
+   KeySym keysym;
+   const char **v;
+   int seek;         /* Seconds the command seeks by, for prefetching the target; 0 if it isn't a seek */
+   const XOMX_step *macro;   /* Steps to run in order instead of v */
+} XOMX_key;
+
+/* Scheduling of a class of player, see prioRun() */
+typedef struct {
+   int nice;
+   int ioClass, ioLevel;   /* ioprio: 2 best effort (level 0 highest - 7), 3 idle */
+   unsigned long cpus;     /* CPU mask, 0: all */
+} XOMX_prio;
+
+/* A slot of a wall layout, omxplayer coordinates; w 0: the slot isn't used (its window is unmapped) */
+typedef struct {
+   int x, y;
+   unsigned int w, h;
+   const char *file;   /* Play this instead, NULL: carry on with the playlist */
+} XOMX_rect;
+
+/* A box body in a mapped mp4 file */
+typedef struct {
+   const unsigned char *p;
+   unsigned long long len;
+} XOMX_box;
+
+/* Sample tables of the video track, see seekOffset() */
+typedef struct {
+   unsigned int timescale;    /* Track time units per second (mdhd) */
+   XOMX_box stts, stss, stsc, stco, co64;
+} XOMX_stbl;
+
+/* Source properties read from the file header by probeFile(); zero if unknown */
+typedef struct {
+   int width;
+   int height;
+   double duration;  /* seconds */
+   long long size;   /* bytes */
+   dev_t dev;        /* Device the file is on */
+   time_t mtime;
+   char codec[5];    /* Video sample format, e.g. avc1 */
+   int keyframes;    /* Sync samples in the video track */
+   int subtitles;    /* Subtitle tracks, -1 if unknown (not mp4) */
+   char handler[5];  /* Track type (hdlr) while a trak is parsed */
+} XOMX_probe;
+
+static Display *dis;
+static Window win;
+/* Command variables for config */
+static char pid[16];
+static char layerParam[16];    /* omxplayer layer: pid, or the restored session's */
+static char dbusParam[128];    /* Store for dbus name parameter */
+static char destParam[256];    /* dest parameter for dbus constol */
+static char winParam[32];      /* Requested OMX window size */
+static char resizeParam[64];   /* Resize parameter for dbus control */
+static char videoFile[4096];   /* File given to omxplayer: sourceFile, or its staged copy */
+static char sourceFile[4096];  /* File to play with path */
+static XOMX_probe probe;       /* Header info for sourceFile */
+static char **playlist;        /* Files to play in order */
+static int playlistLen, playlistCur;
+static char schedFile[4096];   /* Schedule (--schedule), empty if none */
+static int tileCount;          /* Mosaic tiles (-m), 0 if not a mosaic */
+Atom wmDeleteMessage;
+static Atom netOpaqueRegion;
+static Atom netFrameExtents;
+
+/* Root relative geometry of win, kept up to date from events by trackGeometry() */
+typedef struct {
+   Window frame;        /* Window manager frame (parent of win), None if win is a child of the root */
+   int frameX, frameY;  /* Root position of the inside of frame */
+   int frameBw;         /* Border width of frame */
+   int offX, offY;      /* Position of win in frame */
+   int x, y;            /* Root position of win */
+   int w, h;
+} XOMX_geom;
+static XOMX_geom geom;
+static int geomGiven;   /* Create win at geom (restored session) rather than the default */
+
+/* Config */
+static char className[] = "xomxplayer";
+static const char omxplayerFont[]="/usr/share/fonts/TTF/Vera.ttf";
+static const char omxplayerItFont[]="/usr/share/fonts/TTF/VeraIt.ttf";
+static const int hideOnMove=0;  /* 1: hide the video while the window is being moved / resized */
+static const int autoBuffer=0;  /* 1: size omxplayer's buffers from the bitrate and storage speed */
+static const long tuneLogMax=1<<20;   /* tuning.log size at which it is rotated */
+static const int seekPrefetchMs=50;   /* Longest wait for the seek target to be read in before seeking; 0: don't prefetch */
+static const int stageAhead=0;   /* Playlist items to copy into memory ahead of playing, 0: off */
+static const long long stageBudget=256LL<<20;   /* Memory for staged copies, bytes */
+static const int visHideMs=250;   /* Time the window must stay fully obscured before the video is hidden */
+static const int visShowMs=80;    /* Time it must stay unobscured before the video is shown again */
+static const int renditionSwitch=0;   /* 1: play the smallest rendition (file.720p.mp4 etc.) which covers the window */
+static const int renditionHoldMs=10000;
+static const int overrideRedirect=0;   /* 1: unmanaged window - no window manager moves, resizes or decorations */
+static const int xRetryMinMs=500;      /* Reconnect backoff after the X server has gone: first retry */
+static const int xRetryMaxMs=30000;    /* Longest wait between retries */
+static const int metricsMs=0;          /* Interval for the metrics textfile (e.g. 15000), 0: off */
+static const char metricsDir[]="/var/lib/node_exporter/textfile_collector";
+static const int playLog=0;            /* 1: keep proof of play records in ~/.cache/xomxplayer/playlog */
+static const int playLogBatchMs=2000;  /* Records are synced to disk in batches at most this old */
+static const long playLogSegment=1<<20;   /* Bytes per log file before starting the next */
+static const int playLogSegments=64;   /* Log files kept */
+static const int sessionPosS=10;       /* The session snapshot's position is brought up to date every this many seconds */
+static const int restoreFollowClock=0; /* 1: --restore adds the time the session was down, as if it had played on */
+static const int audioElideMs=10000;   /* Players not heard for this long are restarted without audio decoding; 0: only muted */
+static const int audioSettleMs=1000;   /* A player is restarted with audio once it has been heard this long */
+static const int audioGapMs=5000;      /* Least time between two restarts of one player */
+static const int wallAudioSlot=0;      /* The wall slot which is heard */
+static const int muteHidden=0;         /* 1: a player whose window is obscured isn't heard either */
+static const XOMX_prio playerClass[]={
+   { 0, 2, 0, 0 },     /* Watched */
+   { 5, 2, 4, 0 },     /* Background: other tiles of a mosaic */
+   { 15, 3, 0, 0x1 },  /* Hidden: idle I/O, first CPU only */
+};
+static const int prioDemoteMs=3000;    /* A player must be in a lower class this long before it is moved down */
+static const int poolSize=0;           /* 1: start the next playlist item ahead, paused and hidden; 0: off */
+static const long poolMinFreeMB=128;   /* Memory to leave free beyond the warm player */
+static const int poolAheadS=15;        /* Warm the first file of a schedule entry due within this many seconds */
+static const double poolMaxPressure=10;   /* Memory PSI some avg10 (%) above which there is no warm player */
+static const int mosaicCrop=0;         /* 1: mosaic tiles are filled, cropping the source to the tile; 0: letterboxed */
+static const int layoutRevealMs=1000;  /* Longest a layout switch waits for the other slots before showing the video */
+static const XOMX_rect layouts[][4]={   /* Wall presets, one rectangle per slot (--slot <n>) */
+   { { 0, 0, 1920, 1080 } },   /* One big video */
+   { { 0, 0, 960, 540 }, { 960, 0, 960, 540 }, { 0, 540, 960, 540 }, { 960, 540, 960, 540 } },   /* 2x2 grid */
+};
+
+/* Commands to run omxplayer, quit omxplayer and resize / reposition the window. These must be present
+ * Font and --sid args are dropped per file and --no-osd added for the kms driver, see buildPlayerArgs()
+ */
+static const char *omxplayer[]={ "omxplayer.bin", "--font", omxplayerFont, "--italic-font", omxplayerItFont, "--sid", "1", "--no-keys", "--dbus_name", dbusParam, "--layer", layerParam, "--win", winParam, "--aspect-mode", "Letterbox", videoFile, NULL };
+static const char *playerArgs[LENGTH(omxplayer)+17];   /* omxplayer[] with the tuned buffer arguments, see buildPlayerArgs() */
+static char tuneParam[4][16];
+static char posParam[16];      /* --pos for a restart, hh:mm:ss */
+static int audioOff;           /* Start omxplayer without audio (--aidx -1), see audioRun() */
+static pid_t omxplayer_pid;
+static long long playerStart;   /* When omxplayer_pid was started */
+static int playerReady;         /* omxplayer_pid has answered on dbus */
+static const char *quit_player[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Quit", NULL };
+static const char *resize_player[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.VideoPos", "objpath:/not/used", resizeParam, NULL };
+static const char *hide_video[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:28", NULL };
+static const char *unhide_video[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:29", NULL };
+
+/* Other dbus commands 
+ * See https://github.com/popcornmix/omxplayer/blob/master/README.md
+ */
+static const char *pause_player[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:16", NULL };
+static const char *stop_player[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:15", NULL };
+static const char *seek_back_small[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:19", NULL };
+static const char *seek_forward_small[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:20", NULL };
+static const char *seek_back_large[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:21", NULL };
+static const char *seek_forward_large[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:22", NULL };
+static const char *get_position[]={ "dbus-send", "--print-reply=literal", "--reply-timeout=500", "--session", destParam, "/org/mpris/MediaPlayer2", "org.freedesktop.DBus.Properties.Position", NULL };
+static char cropParam[64];     /* string:x1 y1 x2 y2 for set_crop, source pixels */
+static const char *set_crop[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.SetVideoCropPos", "objpath:/not/used", cropParam, NULL };
+static const char *toggle_subtitle[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:12", NULL };
+static const char *play_player[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Play", NULL };
+static const char *mute_player[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Mute", NULL };
+static const char *unmute_player[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Unmute", NULL };
+static char setPosParam[32];   /* int64:<microseconds> for set_position, filled in by a macroSetPosition step */
+static const char *set_position[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.SetPosition", "objpath:/not/used", setPosParam, NULL };
+
+/* Macros: each step is started when the one before it has finished */
+static const XOMX_step showFrom10m[]={ { NULL, macroSetPosition, 600 }, { play_player }, { NULL, macroFullScreen }, { unmute_player }, { NULL } };
+
+/* See /usr/include/X11/keysymdef.h for keycodes */
+static KeySym quitKey=XK_q;
+static KeySym fullScreenKey=XK_f;
+static KeySym layoutKey=XK_l;   /* Next wall layout */
+static KeySym tileFocusKey=XK_Tab;   /* Next mosaic tile */
+static XOMX_key keys[]= {
+   { XK_p,         pause_player },
+   { XK_s,         stop_player },
+   { XK_Left,      seek_back_small, -30 },
+   { XK_Right,     seek_forward_small, 30 },
+   { XK_Page_Up,   seek_forward_large, 600 },
+   { XK_Page_Down, seek_back_large, -600 },
+   { XK_v,         toggle_subtitle },
+   { XK_F1,        NULL, 0, showFrom10m },
+};
+
+/* Measured service time of a dbus command: spawn() to child exit, which with --print-reply is omxplayer's reply, in microseconds */
+typedef struct {
+   const char **v;      /* Command, NULL for a free slot */
+   char name[32];       /* Method name used in the stats file, e.g. VideoPos, Action:28 */
+   long ewma;
+   long p90;            /* Running 90th percentile estimate */
+   unsigned long count;
+   pid_t pid;           /* Last instance started, 0 once it has finished */
+   long long start;
+} XOMX_cmdstat;
+
+static XOMX_cmdstat cmdStats[32];
+static char hwModel[64];
+
+/* Monotonic clock in microseconds, for timing */
+static long long nowUs(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+/* Stats slot for command v, created on first use. NULL if v isn't a dbus command or the table is full */
+static XOMX_cmdstat *cmdStat(const char **v) {
+   unsigned int i, m;
+   const char *method;
+
+   if (strcmp(v[0], "dbus-send"))
+      return NULL;
+   for (i=0; i<LENGTH(cmdStats) && cmdStats[i].v!=NULL; i++) {
+      if (cmdStats[i].v==v)
+         return &cmdStats[i];
+   }
+   for (m=1; v[m]!=NULL && strcmp(v[m], "/org/mpris/MediaPlayer2"); m++);   /* Method follows the object path */
+   if (i==LENGTH(cmdStats) || v[m]==NULL || v[++m]==NULL)
+      return NULL;
+   method=strrchr(v[m], '.');
+   method=method ? method+1 : v[m];
+   if (!strcmp(method, "Action") && v[m+1]!=NULL && !strncmp(v[m+1], "int32:", 6))
+      snprintf(cmdStats[i].name, sizeof(cmdStats[i].name), "Action:%s", v[m+1]+6);
+   else
+      snprintf(cmdStats[i].name, sizeof(cmdStats[i].name), "%s", method);
+   cmdStats[i].v=v;
+   return &cmdStats[i];
+}
+
+/* Called by spawn() */
+static void cmdStart(const char **v, pid_t chld_pid) {
+   XOMX_cmdstat *st=cmdStat(v);
+
+   if (st==NULL)
+      return;
+   st->pid=chld_pid;
+   st->start=nowUs();
+}
+
+/* Called when child chld_pid has been reaped; updates the stats of the command it was running */
+static void cmdDone(pid_t chld_pid) {
+   unsigned int i;
+   long t, step;
+   XOMX_cmdstat *st;
+
+   for (i=0; i<LENGTH(cmdStats) && cmdStats[i].v!=NULL; i++) {
+      st=&cmdStats[i];
+      if (st->pid!=chld_pid)
+         continue;
+      st->pid=0;
+      t=(long)(nowUs()-st->start);
+      if (st->count++==0) {
+         st->ewma=t;
+         st->p90=t;
+      }
+      else {
+         st->ewma+=(t-st->ewma)/8;
+         step=st->ewma/16+100;
+         if (t > st->p90)
+            st->p90+=step*9/10;
+         else
+            st->p90-=step/10;
+         if (st->p90 < 0)
+            st->p90=0;
+      }
+      return;
+   }
+}
+
+/* Microseconds until command v may be sent again without queueing behind the last one; 0 to send now */
+static long cmdWait(const char **v) {
+   XOMX_cmdstat *st=cmdStat(v);
+   long elapsed;
+
+   if (st==NULL || (st->count==0 && st->pid==0))
+      return 0;
+   elapsed=(long)(nowUs()-st->start);
+   if (elapsed >= st->p90)
+      return (st->pid!=0) ? 10000 : 0;  /* Still running: poll */
+   return st->p90-elapsed;
+}
+
+/* Path of name in the cache directory ($XDG_CACHE_HOME or ~/.cache)/xomxplayer, which is created if needed.
+ * Returns 0 on success.
+ */
+static int cachePath(char *buf, size_t len, const char *name) {
+   const char *xdg=getenv("XDG_CACHE_HOME");
+   const char *home=getenv("HOME");
+   char dir[4096];
+   int n;
+
+   if (xdg!=NULL && xdg[0]!='\0')
+      snprintf(dir, sizeof(dir), "%s", xdg);
+   else if (home!=NULL)
+      snprintf(dir, sizeof(dir), "%s/.cache", home);
+   else
+      return 1;
+   mkdir(dir, 0755);
+   strncat(dir, "/xomxplayer", sizeof(dir)-strlen(dir)-1);
+   mkdir(dir, 0755);
+   n=snprintf(buf, len, "%s/%s", dir, name);
+   return (n < 0 || (size_t)n >= len);
+}
+
+/* Hardware model, used to key the saved command stats */
+static void readModel(void) {
+   FILE *f;
+   char *c;
+
+   strcpy(hwModel, "unknown");
+   f=fopen("/proc/device-tree/model", "r");
+   if (f==NULL)
+      return;
+   if (fgets(hwModel, sizeof(hwModel), f)==NULL)
+      strcpy(hwModel, "unknown");
+   fclose(f);
+   for (c=hwModel; *c; c++) {
+      if (*c=='\t' || *c=='\n')
+         *c=' ';
+   }
+}
+
+/* Load the saved command stats for this hardware model. Commands are matched by name */
+static void loadCmdStats(const char **cmds[], unsigned int n) {
+   char path[4096], line[256], model[64], name[32];
+   long ewma, p90;
+   unsigned long count;
+   unsigned int i;
+   XOMX_cmdstat *st;
+   FILE *f;
+
+   readModel();
+   for (i=0; i<n; i++)
+      cmdStat(cmds[i]);
+   if (cachePath(path, sizeof(path), "cmdstats") || (f=fopen(path, "r"))==NULL)
+      return;
+   while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "%63[^\t]\t%31[^\t]\t%ld\t%ld\t%lu", model, name, &ewma, &p90, &count)!=5 || strcmp(model, hwModel))
+         continue;
+      for (i=0; i<LENGTH(cmdStats) && cmdStats[i].v!=NULL; i++) {
+         st=&cmdStats[i];
+         if (!strcmp(st->name, name)) {
+            st->ewma=ewma;
+            st->p90=p90;
+            st->count=count;
+         }
+      }
+   }
+   fclose(f);
+}
+
+/* Save the command stats for this model, keeping the lines of other models */
+static void saveCmdStats(void) {
+   char path[4096], tmp[4112], line[256], model[64];
+   unsigned int i;
+   FILE *f, *out;
+
+   if (cachePath(path, sizeof(path), "cmdstats"))
+      return;
+   snprintf(tmp, sizeof(tmp), "%s.%i", path, getpid());
+   out=fopen(tmp, "w");
+   if (out==NULL)
+      return;
+   if ((f=fopen(path, "r"))!=NULL) {
+      while (fgets(line, sizeof(line), f)) {
+         if (sscanf(line, "%63[^\t]", model)==1 && strcmp(model, hwModel))
+            fputs(line, out);
+      }
+      fclose(f);
+   }
+   for (i=0; i<LENGTH(cmdStats) && cmdStats[i].v!=NULL; i++) {
+      if (cmdStats[i].count > 0)
+         fprintf(out, "%s\t%s\t%ld\t%ld\t%lu\n", hwModel, cmdStats[i].name, cmdStats[i].ewma, cmdStats[i].p90, cmdStats[i].count);
+   }
+   if (fclose(out) || rename(tmp, path))
+      unlink(tmp);
+}
+
+static unsigned long spawnCount;
+static unsigned long childExits[3];   /* Exited 0, exited non-zero, killed by a signal */
+
+/* Count a child's exit status for the metrics; every waitpid() that reaps one calls this */
+static void childExited(int status) {
+   childExits[WIFSIGNALED(status) ? 2 : (WEXITSTATUS(status)!=0)]++;
+}
+
+/* Adapted from dwm spawn() (http://suckless.org/)
+ * If outfd isn't -1 it becomes the child's stdout.
+ */
+static pid_t spawnFd(const char **arg, int outfd) {
+   pid_t chld_pid;
+#ifdef DEBUG
+   int i=0;
+   fprintf(stderr, "exec ");
+   while (arg[i]!=NULL) {
+      fprintf(stderr, "%s ",arg[i]);
+      i++;
+   }
+   fprintf(stderr, "\n");
+#endif
+   chld_pid=fork();
+   if (chld_pid==0) {
+      if (dis)
+         close(ConnectionNumber(dis));
+      if (outfd!=-1)
+         dup2(outfd, STDOUT_FILENO);
+      else if (!strcmp(arg[0], "dbus-send") && (outfd=open("/dev/null", O_WRONLY))!=-1)
+         dup2(outfd, STDOUT_FILENO);   /* The reply is only waited for, to time the command */
+      setsid();
+      execvp(((char **)arg)[0], (char **)arg);
+      fprintf(stderr, "xomxplayer: execvp %s", ((char **)arg)[0]);
+      perror(" failed");
+      exit(EXIT_SUCCESS);
+   }
+   if (chld_pid > 0) {
+      cmdStart(arg, chld_pid);
+      spawnCount++;
+   }
+   return chld_pid;
+}
+
+static pid_t spawn(const char **arg) {
+   return spawnFd(arg, -1);
+}
+
+/* Wait for a command started by spawn() to finish, so commands to omxplayer are applied in order.
+ * Returns 0 if the command succeeded.
+ */
+static int spawnWait(const char **arg) {
+   pid_t chld_pid;
+   int chld_status;
+
+   chld_pid=spawn(arg);
+   if (chld_pid < 1)
+      return 1;
+   while (waitpid(chld_pid, &chld_status, 0)==-1) {
+      if (errno!=EINTR)
+         return 1;
+   }
+   cmdDone(chld_pid);
+   childExited(chld_status);
+   return !(WIFEXITED(chld_status) && WEXITSTATUS(chld_status)==0);
+}
+
+/* Run a command and read its output into out (NUL terminated). Returns 0 if it succeeded */
+static int spawnRead(const char **arg, char *out, size_t len) {
+   int fds[2];
+   pid_t chld_pid;
+   int chld_status;
+   size_t n=0;
+   ssize_t r;
+
+   out[0]='\0';
+   if (pipe(fds))
+      return 1;
+   chld_pid=spawnFd(arg, fds[1]);
+   close(fds[1]);
+   while (chld_pid > 0 && n+1 < len && ((r=read(fds[0], out+n, len-n-1)) > 0 || (r==-1 && errno==EINTR)))
+      n+=(r > 0) ? r : 0;
+   out[n]='\0';
+   close(fds[0]);
+   if (chld_pid < 1)
+      return 1;
+   while (waitpid(chld_pid, &chld_status, 0)==-1) {
+      if (errno!=EINTR)
+         return 1;
+   }
+   cmdDone(chld_pid);
+   childExited(chld_status);
+   return !(WIFEXITED(chld_status) && WEXITSTATUS(chld_status)==0);
+}
+
+/* Big endian readers for the mp4 box parser */
+static unsigned int rd32(const unsigned char *p) {
+   return (unsigned int)p[0]<<24 | (unsigned int)p[1]<<16 | (unsigned int)p[2]<<8 | p[3];
+}
+
+static unsigned long long rd64(const unsigned char *p) {
+   return (unsigned long long)rd32(p)<<32 | rd32(p+4);
+}
+
+/* Walk the ISO BMFF (mp4, m4v, mov) boxes between p and end, descending into the containers that lead to
+ * the track headers and sample tables. Each trak is read into its own XOMX_probe and the largest video track kept.
+ * If tab isn't NULL it is pointed at the sample tables of that track.
+ */
+static void probeBoxes(const unsigned char *p, const unsigned char *end, XOMX_probe *info, XOMX_stbl *tab) {
+   unsigned long long size;
+   unsigned int hdr;
+   const unsigned char *body;
+   XOMX_probe track;
+   XOMX_stbl trackTab;
+   XOMX_box *b=NULL;
+
+   while (end-p >= 8) {
+      size=rd32(p);
+      hdr=8;
+      if (size==1) {
+         if (end-p < 16)
+            return;
+         size=rd64(p+8);
+         hdr=16;
+      }
+      else if (size==0)
+         size=end-p;
+      if (size < hdr || size > (unsigned long long)(end-p))
+         return;   /* Truncated or corrupt */
+      body=p+hdr;
+
+      if (!memcmp(p+4, "moov", 4) || !memcmp(p+4, "mdia", 4) || !memcmp(p+4, "minf", 4) || !memcmp(p+4, "stbl", 4))
+         probeBoxes(body, p+size, info, tab);
+      else if (!memcmp(p+4, "trak", 4)) {
+         memset(&track, 0, sizeof(track));
+         memset(&trackTab, 0, sizeof(trackTab));
+         probeBoxes(body, p+size, &track, &trackTab);
+         if (!strcmp(track.handler, "sbtl") || !strcmp(track.handler, "text") || !strcmp(track.handler, "subt"))
+            info->subtitles++;
+         if (track.width*track.height > info->width*info->height) {  /* Audio tracks are 0x0 */
+            if (tab)
+               *tab=trackTab;
+            info->width=track.width;
+            info->height=track.height;
+            memcpy(info->codec, track.codec, sizeof(info->codec));
+            info->keyframes=track.keyframes;
+         }
+      }
+      else if (!memcmp(p+4, "mvhd", 4) && size-hdr >= 32) {
+         if (body[0]==1 && rd32(body+20))
+            info->duration=(double)rd64(body+24)/rd32(body+20);
+         else if (body[0]==0 && rd32(body+12))
+            info->duration=(double)rd32(body+16)/rd32(body+12);
+      }
+      else if (!memcmp(p+4, "tkhd", 4) && size-hdr >= 84 && size-hdr >= ((body[0]==1) ? 96 : 84)) {
+         body+=(body[0]==1) ? 88 : 76;  /* width / height are 16.16 fixed point after the matrix */
+         info->width=rd32(body)>>16;
+         info->height=rd32(body+4)>>16;
+      }
+      else if (!memcmp(p+4, "stsd", 4) && size-hdr >= 16)
+         memcpy(info->codec, body+12, 4);   /* Format of the first sample entry, e.g. avc1 */
+      else if (!memcmp(p+4, "stss", 4) && size-hdr >= 8)
+         info->keyframes=rd32(body+4);
+      else if (!memcmp(p+4, "hdlr", 4) && size-hdr >= 12)
+         memcpy(info->handler, body+8, 4);
+      if (tab!=NULL) {
+         if (!memcmp(p+4, "mdhd", 4) && size-hdr >= 24)
+            tab->timescale=rd32(body+((body[0]==1) ? 20 : 12));
+         b=!memcmp(p+4, "stts", 4) ? &tab->stts : !memcmp(p+4, "stss", 4) ? &tab->stss : !memcmp(p+4, "stsc", 4) ? &tab->stsc :
+           !memcmp(p+4, "stco", 4) ? &tab->stco : !memcmp(p+4, "co64", 4) ? &tab->co64 : NULL;
+         if (b!=NULL && size-hdr >= 8) {
+            b->p=body;
+            b->len=size-hdr;
+         }
+      }
+      p+=size;
+   }
+}
+
+/* Parse the header of the open file fd, whose stat is st, into info */
+static void probeFd(int fd, const struct stat *st, XOMX_probe *info) {
+   unsigned char *map;
+
+   memset(info, 0, sizeof(*info));
+   info->size=st->st_size;
+   info->dev=st->st_dev;
+   info->mtime=st->st_mtime;
+   info->subtitles=-1;
+   if (st->st_size < 8)
+      return;
+   info->subtitles=0;
+   map=mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (map==MAP_FAILED)
+      return;
+   probeBoxes(map, map+st->st_size, info, NULL);
+   munmap(map, st->st_size);
+   if (info->width==0)
+      info->subtitles=-1;
+}
+
+/* Metadata cache: ~/.cache/xomxplayer/metadata holds metaHeader, then one line per file,
+ *    mtime size width height duration codec keyframes subtitles path
+ * separated by tabs. New entries are appended, so a later line for the same path replaces an earlier one;
+ * the indexer (-i) rewrites the file without the stale lines. A file with another header (or none, before the
+ * format was versioned) is removed on opening; bump the version when the fields change.
+ */
+static const char metaHeader[]="xomxplayer metadata 2\n";
+
+/* Open the cache for reading past the header. Returns NULL if there is none of this version */
+static FILE *metaOpen(const char *cache) {
+   char line[64];
+   FILE *f;
+
+   if ((f=fopen(cache, "r"))==NULL)
+      return NULL;
+   if (fgets(line, sizeof(line), f)==NULL || strcmp(line, metaHeader)) {
+      fclose(f);
+      unlink(cache);
+   #ifdef DEBUG
+      fprintf(stderr, "Metadata cache %s is of another version, removed.\n", cache);
+   #endif
+      return NULL;
+   }
+   return f;
+}
+
+/* Open the cache for appending, starting it with the header if it is new */
+static FILE *metaOpenAppend(const char *cache) {
+   FILE *f;
+
+   if ((f=fopen(cache, "a"))==NULL)
+      return NULL;
+   fseek(f, 0, SEEK_END);
+   if (ftell(f)==0)
+      fputs(metaHeader, f);
+   return f;
+}
+
+static void metaWrite(FILE *f, const char *path, const XOMX_probe *info) {
+   fprintf(f, "%lld\t%lld\t%i\t%i\t%.3f\t%s\t%i\t%i\t%s\n", (long long)info->mtime, info->size, info->width, info->height,
+      info->duration, info->codec[0] ? info->codec : "-", info->keyframes, info->subtitles, path);
+}
+
+/* Parse a cache line into info. Returns a pointer to the path (within line) or NULL if the line is invalid */
+static char *metaRead(char *line, XOMX_probe *info) {
+   long long mtime;
+   int n=0;
+   char *path;
+
+   memset(info, 0, sizeof(*info));
+   if (sscanf(line, "%lld\t%lld\t%i\t%i\t%lf\t%4s\t%i\t%i\t%n", &mtime, &info->size, &info->width, &info->height,
+         &info->duration, info->codec, &info->keyframes, &info->subtitles, &n)!=8 || n==0)
+      return NULL;
+   info->mtime=mtime;
+   if (!strcmp(info->codec, "-"))
+      info->codec[0]='\0';
+   path=line+n;
+   path[strcspn(path, "\n")]='\0';
+   return path;
+}
+
+/* Index of the metadata cache: the offset of the latest line for each path, keyed by a 64 bit hash of the path in
+ * an open addressed table. It is built in one pass and rebuilt only when the file was changed by someone else (the
+ * indexer rewriting it, another instance appending), so a lookup is a probe of the table and one pread().
+ */
+typedef struct {
+   unsigned long long hash;
+   long long off;          /* -1: empty */
+} XOMX_metaslot;
+
+static XOMX_metaslot *metaIndex;
+static size_t metaSlots, metaUsed;
+static struct stat metaSt;     /* The file as indexed */
+
+static unsigned long long metaHash(const char *s) {
+   unsigned long long h=14695981039346656037ULL;
+
+   while (*s)
+      h=(h ^ (unsigned char)*s++)*1099511628211ULL;
+   return h;
+}
+
+static XOMX_metaslot *metaSlot(unsigned long long h) {
+   size_t i;
+
+   for (i=h%metaSlots; metaIndex[i].off!=-1 && metaIndex[i].hash!=h; i=(i+1)%metaSlots)
+      ;
+   return &metaIndex[i];
+}
+
+static void metaIndexAdd(unsigned long long h, long long off) {
+   XOMX_metaslot *old=metaIndex, *slot;
+   size_t i, n=metaSlots;
+
+   if (metaUsed*10 >= metaSlots*7) {   /* Grow */
+      if ((metaIndex=malloc((n ? n*2 : 1024)*sizeof(*metaIndex)))==NULL) {
+         metaIndex=old;
+         return;
+      }
+      metaSlots=n ? n*2 : 1024;
+      for (i=0; i<metaSlots; i++)
+         metaIndex[i].off=-1;
+      metaUsed=0;
+      for (i=0; i<n; i++) {
+         if (old[i].off!=-1)
+            metaIndexAdd(old[i].hash, old[i].off);
+      }
+      free(old);
+   }
+   slot=metaSlot(h);
+   if (slot->off==-1)
+      metaUsed++;
+   slot->hash=h;
+   slot->off=off;   /* A later line replaces an earlier one */
+}
+
+/* Path of a cache line without parsing the fields, NULL if there are too few */
+static char *metaPath(char *line) {
+   int tabs;
+
+   for (tabs=0; tabs < 8; tabs++) {
+      if ((line=strchr(line, '\t'))==NULL)
+         return NULL;
+      line++;
+   }
+   return line;
+}
+
+/* (Re)build the index unless it is of the current file. Returns 1 if there is no cache */
+static int metaIndexLoad(const char *cache) {
+   static char line[4200];
+   struct stat st;
+   long long off=sizeof(metaHeader)-1;
+   size_t i, len;
+   char *p;
+   FILE *f;
+
+   if (stat(cache, &st)==-1)
+      return 1;
+   if (metaIndex!=NULL && st.st_dev==metaSt.st_dev && st.st_ino==metaSt.st_ino && st.st_size==metaSt.st_size &&
+         st.st_mtime==metaSt.st_mtime)
+      return 0;
+   if ((f=metaOpen(cache))==NULL)
+      return 1;
+   for (i=0; i<metaSlots; i++)
+      metaIndex[i].off=-1;
+   metaUsed=0;
+   while (fgets(line, sizeof(line), f)) {
+      len=strlen(line);
+      if ((p=metaPath(line))!=NULL) {
+         p[strcspn(p, "\n")]='\0';
+         metaIndexAdd(metaHash(p), off);
+      }
+      off+=len;
+   }
+   fstat(fileno(f), &metaSt);
+   fclose(f);
+#ifdef DEBUG
+   fprintf(stderr, "metadata cache indexed: %zu entries\n", metaUsed);
+#endif
+   return metaIndex==NULL;
+}
+
+/* Look up path in the metadata cache; the entry is only used if the size and mtime still match st.
+ * Returns 0 if found.
+ */
+static int metaLookup(const char *path, const struct stat *st, XOMX_probe *info) {
+   char cache[4096];
+   static char line[4200];
+   XOMX_metaslot *slot;
+   XOMX_probe entry;
+   ssize_t n;
+   char *p;
+   int fd, found=1;
+
+   info->dev=st->st_dev;
+   if (cachePath(cache, sizeof(cache), "metadata") || metaIndexLoad(cache))
+      return 1;
+   if ((slot=metaSlot(metaHash(path)))->off==-1 || (fd=open(cache, O_RDONLY))==-1)
+      return 1;
+   n=pread(fd, line, sizeof(line)-1, slot->off);
+   close(fd);
+   line[(n > 0) ? n : 0]='\0';
+   line[strcspn(line, "\n")]='\0';
+   if ((p=metaRead(line, &entry))!=NULL && !strcmp(p, path) && entry.mtime==st->st_mtime && entry.size==st->st_size) {
+      *info=entry;
+      info->dev=st->st_dev;
+      found=0;
+   }
+   return found;
+}
+
+/* Append an entry, and to the index if that is current, so the next lookup doesn't rebuild it */
+static void metaAppend(const char *path, const XOMX_probe *info) {
+   char cache[4096];
+   struct stat st;
+   long long off;
+   int current;
+   FILE *f;
+
+   if (strchr(path, '\n') || cachePath(cache, sizeof(cache), "metadata"))
+      return;
+   current=!metaIndexLoad(cache);
+   if ((f=metaOpenAppend(cache))==NULL)
+      return;
+   off=ftell(f);
+   metaWrite(f, path, info);
+   if (fflush(f)==0 && current && off==metaSt.st_size && fstat(fileno(f), &st)==0) {
+      metaIndexAdd(metaHash(path), off);
+      metaSt=st;
+   }
+   fclose(f);
+}
+
+/* Read the header of file into info, from the metadata cache if it is up to date. Returns 0 on success, 1 if
+ * the file can't be read or isn't mp4. Other containers (e.g. Matroska) are not parsed and leave the size and
+ * duration zero; callers fall back to 1920x1080.
+ */
+static int probeFile(const char *file, XOMX_probe *info) {
+   int fd;
+   struct stat st;
+   char path[PATH_MAX];
+
+   memset(info, 0, sizeof(*info));
+   fd=open(file, O_RDONLY);
+   if (fd==-1)
+      return 1;
+   if (fstat(fd, &st) || realpath(file, path)==NULL) {
+      close(fd);
+      return 1;
+   }
+   if (metaLookup(path, &st, info)) {
+      probeFd(fd, &st, info);
+      metaAppend(path, info);
+   }
+   close(fd);
+#ifdef DEBUG
+   fprintf(stderr, "probe: %s %ix%i %.1fs %s\n", file, info->width, info->height, info->duration, info->codec);
+#endif
+   return (info->width > 0) ? 0 : 1;
+}
+
+/* Library indexer (xomxplayer -i <dir>...)
+ * Walks the library directories and fills the metadata cache with a pool of probe threads at idle I/O
+ * priority. Files whose size and mtime match the cache are not read again, and each result is appended to the
+ * cache as it is made, so an interrupted run carries on where it stopped. The cache is compacted at the end.
+ */
+typedef struct {
+   char *path;
+   XOMX_probe info;
+   int fresh;     /* info is up to date */
+} XOMX_meta;
+
+static XOMX_meta *library;
+static size_t libraryLen, librarySize;
+static size_t libraryNext;     /* Next entry for a probe thread */
+static unsigned long libraryProbed;
+static FILE *libraryOut;
+static pthread_mutex_t libraryLock=PTHREAD_MUTEX_INITIALIZER;
+
+static const char *videoExt[]={ ".mp4", ".m4v", ".mov", ".mkv", ".avi", ".ts", ".h264" };
+static const int indexThreads=4;
+
+static XOMX_meta *libraryAdd(const char *path) {
+   XOMX_meta *m;
+
+   if (libraryLen==librarySize) {
+      librarySize=librarySize ? librarySize*2 : 1024;
+      m=realloc(library, librarySize*sizeof(*library));
+      if (m==NULL) {
+         fprintf(stderr, "xomxplayer: out of memory indexing library\n");
+         exit(EXIT_FAILURE);
+      }
+      library=m;
+   }
+   m=&library[libraryLen++];
+   memset(m, 0, sizeof(*m));
+   m->path=strdup(path);
+   return m;
+}
+
+/* Sort by path, keeping the order of equal paths so the last one can win */
+static int libraryCmp(const void *a, const void *b) {
+   const XOMX_meta *ma=a, *mb=b;
+   int c=strcmp(ma->path, mb->path);
+
+   if (c)
+      return c;
+   return (ma < mb) ? -1 : (ma > mb);
+}
+
+static XOMX_meta *libraryFind(const char *path, size_t n) {
+   size_t lo=0, hi=n, mid;
+   int c;
+
+   while (lo < hi) {
+      mid=(lo+hi)/2;
+      c=strcmp(library[mid].path, path);
+      if (c==0)
+         return &library[mid];
+      if (c < 0)
+         lo=mid+1;
+      else
+         hi=mid;
+   }
+   return NULL;
+}
+
+static size_t libraryKnown;   /* Entries loaded from the cache; sorted, one per path */
+
+static int indexVisit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+   XOMX_meta *m;
+   const char *ext=strrchr(path, '.');
+   unsigned int i;
+
+   (void)ftw;
+   if (type!=FTW_F || ext==NULL || strchr(path, '\n'))
+      return 0;
+   for (i=0; i<LENGTH(videoExt) && strcasecmp(ext, videoExt[i]); i++);
+   if (i==LENGTH(videoExt))
+      return 0;
+   m=libraryFind(path, libraryKnown);
+   if (m!=NULL) {
+      m->fresh=(m->info.mtime==st->st_mtime && m->info.size==st->st_size) ? 1 : -1;   /* -1: changed, probe again */
+      return 0;
+   }
+   libraryAdd(path)->fresh=-1;
+   return 0;
+}
+
+static void *indexWorker(void *arg) {
+   XOMX_meta *m;
+   struct stat st;
+   size_t i;
+   int fd;
+
+   (void)arg;
+   for (;;) {
+      pthread_mutex_lock(&libraryLock);
+      while (libraryNext < libraryLen && library[libraryNext].fresh!=-1)
+         libraryNext++;
+      i=libraryNext++;
+      pthread_mutex_unlock(&libraryLock);
+      if (i >= libraryLen)
+         return NULL;
+      m=&library[i];
+      fd=open(m->path, O_RDONLY);
+      if (fd==-1 || fstat(fd, &st)) {
+         if (fd!=-1)
+            close(fd);
+         m->fresh=0;
+         continue;
+      }
+      posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);  /* Only the header boxes are read */
+      probeFd(fd, &st, &m->info);
+      close(fd);
+      m->fresh=1;
+      pthread_mutex_lock(&libraryLock);
+      if (libraryOut)
+         metaWrite(libraryOut, m->path, &m->info);
+      libraryProbed++;
+      pthread_mutex_unlock(&libraryLock);
+   }
+}
+
+static int indexLibrary(char **roots, int n) {
+   char cache[4096], tmp[4112], path[PATH_MAX];
+   static char line[4200];
+   pthread_t threads[16];
+   XOMX_probe info;
+   long long t=nowUs();
+   size_t i, j;
+   char *p;
+   int k, nthreads=0;
+   FILE *f;
+
+   if (cachePath(cache, sizeof(cache), "metadata")) {
+      fprintf(stderr, "xomxplayer: no cache directory (set HOME)\n");
+      return 1;
+   }
+   /* Load the cache, sort it and keep the last line for each path */
+   if ((f=metaOpen(cache))!=NULL) {
+      while (fgets(line, sizeof(line), f)) {
+         if ((p=metaRead(line, &info))!=NULL)
+            libraryAdd(p)->info=info;
+      }
+      fclose(f);
+   }
+   qsort(library, libraryLen, sizeof(*library), libraryCmp);
+   for (i=0, j=0; i<libraryLen; i++) {
+      if (i+1 < libraryLen && !strcmp(library[i].path, library[i+1].path)) {
+         free(library[i].path);
+         continue;
+      }
+      library[j++]=library[i];
+   }
+   libraryLen=libraryKnown=j;
+
+   /* Idle I/O class and a low CPU priority, inherited by the probe threads */
+   syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3<<13 /* IOPRIO_CLASS_IDLE */);
+   if (nice(10)==-1)
+      perror("xomxplayer: nice");
+
+   for (k=0; k<n; k++) {
+      if (realpath(roots[k], path)==NULL) {
+         fprintf(stderr, "xomxplayer: %s", roots[k]);
+         perror("");
+         continue;
+      }
+      nftw(path, indexVisit, 32, FTW_PHYS);
+   }
+
+   libraryOut=metaOpenAppend(cache);
+   for (k=0; k<indexThreads && k<(int)LENGTH(threads); k++) {
+      if (pthread_create(&threads[nthreads], NULL, indexWorker, NULL)==0)
+         nthreads++;
+   }
+   if (nthreads==0)
+      indexWorker(NULL);
+   for (k=0; k<nthreads; k++)
+      pthread_join(threads[k], NULL);
+   if (libraryOut)
+      fclose(libraryOut);
+
+   /* Compact: one line per path, dropping files which no longer exist */
+   snprintf(tmp, sizeof(tmp), "%s.%i", cache, getpid());
+   if ((f=fopen(tmp, "w"))!=NULL) {
+      fputs(metaHeader, f);
+      for (i=0; i<libraryLen; i++) {
+         if (library[i].fresh!=0 || access(library[i].path, F_OK)==0)
+            metaWrite(f, library[i].path, &library[i].info);
+      }
+      if (fclose(f) || rename(tmp, cache))
+         unlink(tmp);
+   }
+   printf("Indexed %zu files (%lu probed) in %.1fs using %i threads.\n", libraryLen, libraryProbed, (nowUs()-t)/1e6, nthreads ? nthreads : 1);
+   return 0;
+}
+
+/* Sequential read speed in bytes/s of the mount file is on, from ~/.cache/xomxplayer/throughput (one line per mount
+ * point). If it isn't known yet it is measured in the background, at idle I/O priority so playback comes first, by
+ * reading up to 16MB from the middle of file with O_DIRECT, so neither the page cache nor what is in it counts.
+ * Returns 0 if unknown.
+ */
+static pthread_mutex_t throughputLock=PTHREAD_MUTEX_INITIALIZER;
+static int throughputBusy;
+
+typedef struct {
+   char file[4096];
+   char mount[4096];   /* As in /proc/self/mounts, spaces escaped */
+   long long size;
+} XOMX_measure;
+
+/* Mount point file is under, escaped as /proc/self/mounts has it. Returns 1 if none is found */
+static int mountOf(const char *file, char *mount, size_t len) {
+   char path[PATH_MAX], line[8192], dir[4096], plain[4096];
+   size_t best=0, n;
+   unsigned int c;
+   int i, j;
+   FILE *f;
+
+   if (realpath(file, path)==NULL || (f=fopen("/proc/self/mounts", "r"))==NULL)
+      return 1;
+   while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "%*s %4095s", dir)!=1)
+         continue;
+      for (i=j=0; dir[i]!='\0'; j++) {   /* \040 etc. */
+         if (dir[i]=='\\' && sscanf(dir+i+1, "%3o", &c)==1) {
+            plain[j]=c;
+            i+=4;
+         }
+         else
+            plain[j]=dir[i++];
+      }
+      plain[j]='\0';
+      n=strlen(plain);
+      if (n >= best && !strncmp(path, plain, n) && (n==1 || path[n]=='/' || path[n]=='\0')) {
+         best=n;
+         snprintf(mount, len, "%s", dir);
+      }
+   }
+   fclose(f);
+   return best==0;
+}
+
+static void *throughputWorker(void *arg) {
+   XOMX_measure *m=arg;
+   char path[4096], tmp[4200], line[4200], key[4096];
+   static char buf[1<<20] __attribute__((aligned(4096)));   /* For O_DIRECT */
+   long long t, total=0, off=(m->size/2) & ~((1LL<<20)-1);
+   double bps;
+   ssize_t n;
+   FILE *f, *out;
+   int fd;
+
+   syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3<<13 /* IOPRIO_CLASS_IDLE */);
+   /* O_DIRECT: the device, not the page cache, and without evicting what the playing omxplayer is about to read.
+    * No measurement where it isn't supported (tmpfs, some network file systems).
+    */
+   if ((fd=open(m->file, O_RDONLY | O_DIRECT))!=-1) {
+      t=nowUs();
+      while (total < (16<<20) && (n=pread(fd, buf, sizeof(buf), off+total)) > 0)
+         total+=n;
+      t=nowUs()-t;
+      close(fd);
+      if (total >= (4<<20) && t > 0 && !cachePath(path, sizeof(path), "throughput")) {
+         bps=(double)total*1000000/t;
+         snprintf(tmp, sizeof(tmp), "%s.%i", path, getpid());
+         if ((out=fopen(tmp, "w"))!=NULL) {   /* Rewritten, so there is one line per mount */
+            if ((f=fopen(path, "r"))!=NULL) {
+               while (fgets(line, sizeof(line), f)) {
+                  if (sscanf(line, "%4095s", key)==1 && strcmp(key, m->mount))
+                     fputs(line, out);
+               }
+               fclose(f);
+            }
+            fprintf(out, "%s %.0f\n", m->mount, bps);
+            if (fclose(out) || rename(tmp, path))
+               unlink(tmp);
+         }
+      }
+   }
+   free(m);
+   pthread_mutex_lock(&throughputLock);
+   throughputBusy=0;
+   pthread_mutex_unlock(&throughputLock);
+   return NULL;
+}
+
+static double readThroughput(const char *file, const XOMX_probe *info) {
+   char path[4096], line[4200], key[4096], mount[4096];
+   double bps=0;
+   XOMX_measure *m;
+   pthread_t thread;
+   FILE *f;
+
+   if (mountOf(file, mount, sizeof(mount)) || cachePath(path, sizeof(path), "throughput"))
+      return 0;
+   if ((f=fopen(path, "r"))!=NULL) {
+      while (fgets(line, sizeof(line), f)) {
+         if (sscanf(line, "%4095s %lf", key, &bps)==2 && !strcmp(key, mount))
+            break;
+         bps=0;
+      }
+      fclose(f);
+   }
+   if (bps > 0 || info->size < (32<<20))  /* Cached, or too small to time away from the start */
+      return bps;
+   pthread_mutex_lock(&throughputLock);
+   if (!throughputBusy && (m=malloc(sizeof(*m)))!=NULL) {
+      snprintf(m->file, sizeof(m->file), "%s", file);
+      snprintf(m->mount, sizeof(m->mount), "%s", mount);
+      m->size=info->size;
+      if (pthread_create(&thread, NULL, throughputWorker, m)==0) {
+         pthread_detach(thread);
+         throughputBusy=1;
+      }
+      else
+         free(m);
+   }
+   pthread_mutex_unlock(&throughputLock);
+   return 0;
+}
+
+/* Append a line to ~/.cache/xomxplayer/tuning.log, which is rotated to tuning.log.1 at tuneLogMax bytes */
+static void tuneLog(const char *fmt, ...) {
+   char path[4096], old[4200];
+   struct stat st;
+   va_list ap;
+   FILE *f;
+
+   if (cachePath(path, sizeof(path), "tuning.log"))
+      return;
+   if (stat(path, &st)==0 && st.st_size >= tuneLogMax) {
+      snprintf(old, sizeof(old), "%s.1", path);
+      rename(path, old);
+   }
+   if ((f=fopen(path, "a"))==NULL)
+      return;
+   fprintf(f, "%lld ", (long long)time(NULL));
+   va_start(ap, fmt);
+   vfprintf(f, fmt, ap);
+   va_end(ap);
+   fclose(f);
+}
+
+static double clampd(double v, double lo, double hi) {
+   return (v < lo) ? lo : (v > hi) ? hi : v;
+}
+
+/* The vc4 kms / fkms driver is loaded: omxplayer's OSD and subtitle renderer can't be used */
+static int kmsDriver(void) {
+   return access("/sys/module/vc4", F_OK)==0 && access("/dev/dri/card0", F_OK)==0;
+}
+
+/* Subtitles may be shown for sourceFile: it has subtitle tracks, isn't mp4 (unknown), or has a .srt next to it */
+static int hasSubtitles(void) {
+   char srt[4200];
+   const char *ext=strrchr(sourceFile, '.');
+
+   if (probe.subtitles!=0)
+      return 1;
+   snprintf(srt, sizeof(srt), "%.*s.srt", (ext && !strchr(ext, '/')) ? (int)(ext-sourceFile) : (int)strlen(sourceFile), sourceFile);
+   return access(srt, R_OK)==0;
+}
+
+/* Build playerArgs[] from omxplayer[] for sourceFile.
+ * Options for things the file doesn't need are left out: fonts and --sid without subtitles or under kms (which
+ * also gets --no-osd).
+ * Buffer sizes are chosen for the file's bitrate and how fast it can be read. The more headroom the storage has
+ * over the bitrate, the less needs to be buffered; queue sizes are kept within 1-40MB (demuxer queue) and 1-8MB
+ * (GPU fifo). pos (seconds) is the start position.
+ */
+static void buildPlayerArgs(double pos) {
+   unsigned int i, j=0;
+   double bitrate, bps, ratio, secs, threshold;
+   int kms=kmsDriver();
+   int subs=!kms && hasSubtitles();
+
+   if (kms)
+      playerArgs[j++]="--no-osd";
+   if (audioOff) {
+      playerArgs[j++]="--aidx";
+      playerArgs[j++]="-1";
+   }
+   for (i=0; omxplayer[i]!=NULL; i++) {
+      if (omxplayer[i+1]!=NULL && !subs && (!strcmp(omxplayer[i], "--font") || !strcmp(omxplayer[i], "--italic-font") ||
+            !strcmp(omxplayer[i], "--sid"))) {
+         i++;  /* Skip the option and its value */
+         continue;
+      }
+      if (omxplayer[i+1]==NULL && pos >= 1) {
+         snprintf(posParam, sizeof(posParam), "%02i:%02i:%02i", (int)pos/3600, (int)pos/60%60, (int)pos%60);
+         playerArgs[j++]="--pos";
+         playerArgs[j++]=posParam;
+      }
+      if (omxplayer[i+1]==NULL && autoBuffer && probe.duration > 0 && probe.size > 0) {  /* Before the file name */
+         bitrate=probe.size/probe.duration;   /* bytes/s */
+         bps=readThroughput(sourceFile, &probe);
+         ratio=(bps > 0) ? bps/bitrate : 2;   /* Not measured yet: middle sized buffers */
+         if (ratio >= 4) {          /* Fast storage: small buffers */
+            secs=2;
+            threshold=0.2;
+         }
+         else if (ratio >= 1.5) {
+            secs=5;
+            threshold=1;
+         }
+         else {                     /* Storage barely keeps up: buffer as much as allowed */
+            secs=10;
+            threshold=5;
+         }
+         snprintf(tuneParam[0], sizeof(tuneParam[0]), "%.0f", clampd(bitrate*secs/(1<<20), 1, 40));
+         snprintf(tuneParam[1], sizeof(tuneParam[1]), "%.1f", clampd(bitrate*secs/4/(1<<20), 1, 8));
+         snprintf(tuneParam[2], sizeof(tuneParam[2]), "%.1f", (ratio >= 4) ? 1.0 : 3.0);
+         snprintf(tuneParam[3], sizeof(tuneParam[3]), "%.1f", threshold);
+         playerArgs[j++]="--video_queue";
+         playerArgs[j++]=tuneParam[0];
+         playerArgs[j++]="--video_fifo";
+         playerArgs[j++]=tuneParam[1];
+         playerArgs[j++]="--audio_fifo";
+         playerArgs[j++]=tuneParam[2];
+         playerArgs[j++]="--threshold";
+         playerArgs[j++]=tuneParam[3];
+         tuneLog("start %s bitrate=%.0fkbit/s storage=%.1fMB/s ratio=%.1f video_queue=%s video_fifo=%s audio_fifo=%s threshold=%s\n",
+            sourceFile, bitrate*8/1000, bps/(1<<20), ratio, tuneParam[0], tuneParam[1], tuneParam[2], tuneParam[3]);
+      }
+      playerArgs[j++]=omxplayer[i];
+   }
+   playerArgs[j]=NULL;
+}
+
+/* Playing position in microseconds, -1 if omxplayer doesn't answer */
+static long long queryPosition(void) {
+   char out[128];
+   long long pos;
+
+   if (spawnRead(get_position, out, sizeof(out)) || sscanf(out, " int64 %lld", &pos)!=1)
+      return -1;
+   return pos;
+}
+
+/* File offset of the chunk holding the keyframe at or before time t (seconds), from the sample tables.
+ * Returns 0 if found.
+ */
+static int seekOffset(const XOMX_stbl *tab, double t, unsigned long long *off) {
+   unsigned long long target, ts=0, count, delta;
+   unsigned long long sample=1, key=1, acc=0, first, next, spc, chunk=0;
+   unsigned int i, n;
+
+   if (tab->timescale==0 || tab->stts.p==NULL || tab->stsc.p==NULL || (tab->stco.p==NULL && tab->co64.p==NULL))
+      return 1;
+   /* Time to sample number (1 based) */
+   target=(unsigned long long)(t*tab->timescale);
+   n=rd32(tab->stts.p+4);
+   for (i=0; i<n && 16+8*(unsigned long long)i <= tab->stts.len; i++) {
+      count=rd32(tab->stts.p+8+8*i);
+      delta=rd32(tab->stts.p+12+8*i);
+      if (delta && ts+count*delta > target) {
+         sample+=(target-ts)/delta;
+         break;
+      }
+      ts+=count*delta;
+      sample+=count;
+   }
+   /* Previous keyframe; every sample is a keyframe without stss */
+   key=sample;
+   if (tab->stss.p!=NULL) {
+      n=rd32(tab->stss.p+4);
+      key=1;
+      for (i=0; i<n && 12+4*(unsigned long long)i <= tab->stss.len && rd32(tab->stss.p+8+4*i) <= sample; i++)
+         key=rd32(tab->stss.p+8+4*i);
+   }
+   /* Sample to chunk (1 based) */
+   n=rd32(tab->stsc.p+4);
+   for (i=0; i<n && 20+12*(unsigned long long)i <= tab->stsc.len; i++) {
+      first=rd32(tab->stsc.p+8+12*i);
+      spc=rd32(tab->stsc.p+12+12*i);
+      next=(i+1<n && 32+12*(unsigned long long)i <= tab->stsc.len) ? rd32(tab->stsc.p+20+12*i) : 0;
+      if (spc==0)
+         return 1;
+      if (next==0 || key <= acc+(next-first)*spc) {
+         chunk=first+(key-acc-1)/spc;
+         break;
+      }
+      acc+=(next-first)*spc;
+   }
+   if (chunk==0)
+      return 1;
+   /* Chunk offset */
+   if (tab->stco.p!=NULL && chunk <= rd32(tab->stco.p+4) && 8+4*chunk <= tab->stco.len)
+      *off=rd32(tab->stco.p+4+4*chunk);
+   else if (tab->co64.p!=NULL && chunk <= rd32(tab->co64.p+4) && 8+8*chunk <= tab->co64.len)
+      *off=rd64(tab->co64.p+8*chunk);
+   else
+      return 1;
+   return 0;
+}
+
+/* Playback position, anchored to the wall clock so it can be worked out without asking omxplayer */
+static double playPos;        /* Seconds at playAnchor */
+static long long playAnchor;  /* CLOCK_REALTIME, microseconds */
+static int playPaused;
+static long long playStartReal;   /* When omxplayer was started, CLOCK_REALTIME */
+static double playStartPos;
+static int playPauses, playSeeks, playHides;   /* Interruptions since then */
+
+static long long realUs(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (long long)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+static double playPosition(void) {
+   return playPos+(playPaused ? 0 : (realUs()-playAnchor)/1e6);
+}
+
+/* Re-anchor after a seek of delta seconds, or a pause toggle */
+static void playMark(double delta, int pause) {
+   playPos=playPosition()+delta;
+   if (playPos < 0)
+      playPos=0;
+   playAnchor=realUs();
+   playPaused^=pause;
+   playPauses+=pause;
+   playSeeks+=(delta!=0);
+}
+
+/* Sample tables of sourceFile for prefetchSeek(), parsed once per file and kept mapped while it plays */
+static struct {
+   char file[PATH_MAX];
+   int fd;
+   unsigned char *map;
+   long long len;
+   XOMX_stbl tab;
+} seekTab={ "", -1, NULL, 0 };
+
+static XOMX_stbl *seekTables(void) {
+   XOMX_probe info;
+   struct stat st;
+
+   if (!strcmp(seekTab.file, sourceFile))
+      return seekTab.map!=NULL ? &seekTab.tab : NULL;
+   if (seekTab.map!=NULL)
+      munmap(seekTab.map, seekTab.len);
+   if (seekTab.fd!=-1)
+      close(seekTab.fd);
+   memset(&seekTab.tab, 0, sizeof(seekTab.tab));
+   seekTab.map=NULL;
+   snprintf(seekTab.file, sizeof(seekTab.file), "%s", sourceFile);   /* Not retried if it fails */
+   if ((seekTab.fd=open(sourceFile, O_RDONLY))==-1)
+      return NULL;
+   if (fstat(seekTab.fd, &st) || st.st_size < 8 ||
+         (seekTab.map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, seekTab.fd, 0))==MAP_FAILED) {
+      seekTab.map=NULL;
+      return NULL;
+   }
+   seekTab.len=st.st_size;
+   memset(&info, 0, sizeof(info));
+   probeBoxes(seekTab.map, seekTab.map+seekTab.len, &info, &seekTab.tab);
+   return &seekTab.tab;
+}
+
+/* Prefetch in progress, see prefetchSeek() */
+static struct {
+   long long until;      /* 0: none */
+   unsigned long long off, len;
+   double target;
+} seekWant;
+
+/* Read in the part of sourceFile a seek to target seconds will need, so omxplayer doesn't stall on a cold read. Only mp4 files have the sample tables to find it. Called until it returns 0: the
+ * first call starts the read, the following ones poll for it; it is 0 once resident or after seekPrefetchMs.
+ * Returns microseconds until it should be called again.
+ */
+static long long prefetchSeek(double target) {
+   XOMX_stbl *tab;
+   unsigned char vec[64];
+   unsigned long long off, len, i, n;
+   long pg=sysconf(_SC_PAGESIZE);
+
+   if (seekWant.until==0) {
+      if (seekPrefetchMs <= 0 || probe.duration <= 0 || strcmp(videoFile, sourceFile))
+         return 0;   /* A staged copy is already in memory */
+      if (target < 0)
+         target=0;
+      if (target >= probe.duration || (tab=seekTables())==NULL || seekOffset(tab, target, &off) ||
+            off >= (unsigned long long)seekTab.len)
+         return 0;  /* omxplayer stops at the end */
+      /* About two seconds of the file from the keyframe */
+      len=clampd(probe.size/probe.duration*2, 1<<20, 16<<20);
+      off&=~(unsigned long long)(pg-1);
+      if (off+len > (unsigned long long)seekTab.len)
+         len=seekTab.len-off;
+      posix_fadvise(seekTab.fd, off, len, POSIX_FADV_WILLNEED);
+      seekWant.until=nowUs()+seekPrefetchMs*1000LL;
+      seekWant.off=off;
+      seekWant.len=len;
+      seekWant.target=target;
+   }
+   /* Resident? */
+   for (off=0; off < seekWant.len; off+=n*pg) {
+      n=(seekWant.len-off+pg-1)/pg;
+      if (n > sizeof(vec))
+         n=sizeof(vec);
+      if (mincore(seekTab.map+seekWant.off+off, (n*pg < seekWant.len-off) ? n*pg : seekWant.len-off, vec))
+         break;
+      for (i=0; i<n && (vec[i]&1); i++);
+      if (i < n)
+         break;
+   }
+   if (off < seekWant.len && nowUs() < seekWant.until)
+      return 2000;
+#ifdef DEBUG
+   fprintf(stderr, "Seek prefetch: -> %.1fs, %lluKB at %llu, %s after %lli ms.\n", seekWant.target, seekWant.len>>10,
+      seekWant.off, (off >= seekWant.len) ? "resident" : "not resident",
+      (nowUs()-seekWant.until)/1000+seekPrefetchMs);
+#endif
+   seekWant.until=0;
+   return 0;
+}
+
+/* Staging: the next stageAhead playlist items are copied into memory (sealed memfds) by a background thread,
+ * within stageBudget bytes, and omxplayer is given /proc/self/fd/N of the copy if it is complete. This keeps
+ * playback going on storage with read errors or stalls, and the copies can't be dropped like page cache.
+ * Copies furthest from the playing item, behind it first, are dropped to make room.
+ */
+typedef struct {
+   int item;         /* Playlist index, -1 for a free slot */
+   int fd;
+   long long size;
+   int done;         /* Copy complete and sealed */
+} XOMX_stage;
+
+static XOMX_stage stages[8];
+static long long stageUsed;
+static unsigned int stageHits, stageLaunches;
+static int stageFd=-1;        /* Copy omxplayer is being started on */
+static pthread_mutex_t stageLock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stageWake=PTHREAD_COND_INITIALIZER;
+
+/* How far item is from the playing one; items already played are furthest */
+static int stageDistance(int item) {
+   return (item >= playlistCur) ? item-playlistCur : playlistLen+playlistCur-item;
+}
+
+/* Copy file into a new memfd. Returns the fd or -1 */
+static int stageCopy(const char *file, long long size) {
+   static char buf[4<<20];
+   int in, out;
+   ssize_t n=0, w;
+   long long total=0;
+
+   if ((in=open(file, O_RDONLY))==-1)
+      return -1;
+   posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+   out=memfd_create("xomxplayer-stage", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (out!=-1 && ftruncate(out, size)==0) {
+      while (total < size && (n=read(in, buf, sizeof(buf))) > 0) {
+         for (w=0; w < n; ) {
+            ssize_t r=pwrite(out, buf+w, n-w, total+w);
+            if (r <= 0)
+               break;
+            w+=r;
+         }
+         if (w < n)
+            break;
+         total+=n;
+      }
+   }
+   posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);   /* The copy is the cache now */
+   close(in);
+   if (out!=-1 && (total!=size || fcntl(out, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL))) {
+      close(out);
+      return -1;
+   }
+   return out;
+}
+
+static void *stageWorker(void *arg) {
+   struct stat st;
+   long long t;
+   int i, d, item, slot, far, fd;
+   const char *file;
+
+   (void)arg;
+   pthread_mutex_lock(&stageLock);
+   for (;;) {
+      /* Nearest item ahead not yet staged; the playing one is already being read by omxplayer */
+      item=-1;
+      for (d=1; d<=stageAhead && playlistCur+d < playlistLen && item==-1; d++) {
+         for (i=0; i<(int)LENGTH(stages) && !(stages[i].item==playlistCur+d); i++);
+         if (i==(int)LENGTH(stages))
+            item=playlistCur+d;
+      }
+      if (item==-1 || stat(playlist[item], &st) || st.st_size > stageBudget) {
+         pthread_cond_wait(&stageWake, &stageLock);
+         continue;
+      }
+      /* Make room, dropping the furthest copies which are further than item */
+      slot=-1;
+      for (;;) {
+         far=-1;
+         for (i=0; i<(int)LENGTH(stages); i++) {
+            if (stages[i].item==-1)
+               slot=i;
+            else if (stages[i].done && (far==-1 || stageDistance(stages[i].item) > stageDistance(stages[far].item)))
+               far=i;
+         }
+         if (slot!=-1 && stageUsed+st.st_size <= stageBudget)
+            break;
+         if (far==-1 || stageDistance(stages[far].item) <= stageDistance(item))
+            break;
+         if (stages[far].fd!=-1)
+            close(stages[far].fd);
+         stageUsed-=stages[far].size;
+         stages[far].item=-1;
+      }
+      if (slot==-1 || stageUsed+st.st_size > stageBudget) {
+         pthread_cond_wait(&stageWake, &stageLock);
+         continue;
+      }
+      stages[slot].item=item;
+      stages[slot].done=0;
+      stages[slot].size=st.st_size;
+      stageUsed+=st.st_size;
+      file=playlist[item];   /* The playlist may be replaced while copying */
+      pthread_mutex_unlock(&stageLock);
+
+      t=nowUs();
+      fd=stageCopy(file, st.st_size);
+   #ifdef DEBUG
+      fprintf(stderr, "Staged %s: %lli MB in %lli ms%s.\n", file, (long long)st.st_size>>20, (nowUs()-t)/1000, (fd==-1) ? " FAILED" : "");
+   #endif
+
+      pthread_mutex_lock(&stageLock);
+      if (stages[slot].item==-2) {   /* The playlist changed while copying */
+         if (fd!=-1)
+            close(fd);
+         stageUsed-=st.st_size;
+         stages[slot].item=-1;
+         continue;
+      }
+      if (fd==-1) {   /* Leave it to be read from storage */
+         stageUsed-=st.st_size;
+         stages[slot].size=0;
+         stages[slot].fd=-1;
+      }
+      else
+         stages[slot].fd=fd;
+      stages[slot].done=1;
+   }
+   return NULL;
+}
+
+/* Replace the playlist. Copies of the old one are dropped, a copy in progress when it finishes */
+static void stageSetPlaylist(char **list, int len) {
+   unsigned int i;
+
+   pthread_mutex_lock(&stageLock);
+   playlist=list;
+   playlistLen=len;
+   playlistCur=0;
+   for (i=0; i<LENGTH(stages); i++) {
+      if (stages[i].item < 0)
+         continue;
+      if (!stages[i].done) {
+         stages[i].item=-2;
+         continue;
+      }
+      if (stages[i].fd!=-1)
+         close(stages[i].fd);
+      stageUsed-=stages[i].size;
+      stages[i].item=-1;
+   }
+   pthread_cond_signal(&stageWake);
+   pthread_mutex_unlock(&stageLock);
+}
+
+static void stageStart(void) {
+   pthread_t thread;
+   unsigned int i;
+
+   for (i=0; i<LENGTH(stages); i++)
+      stages[i].item=-1;
+   if (stageAhead > 0 && pthread_create(&thread, NULL, stageWorker, NULL)==0)
+      pthread_detach(thread);
+}
+
+/* Play item from the staged copy if it is ready. Sets videoFile and stageFd */
+static void stageUse(int item) {
+   unsigned int i;
+
+   stageFd=-1;
+   snprintf(videoFile, sizeof(videoFile), "%s", sourceFile);
+   if (stageAhead <= 0)
+      return;
+   pthread_mutex_lock(&stageLock);
+   for (i=0; i<LENGTH(stages); i++) {
+      if (stages[i].item==item && stages[i].done && stages[i].fd!=-1) {
+         stageFd=stages[i].fd;
+         snprintf(videoFile, sizeof(videoFile), "/proc/self/fd/%i", stageFd);
+      }
+   }
+   stageLaunches++;
+   stageHits+=(stageFd!=-1);
+   pthread_mutex_unlock(&stageLock);
+#ifdef DEBUG
+   fprintf(stderr, "Staging: %s, %u of %u starts from memory.\n", (stageFd!=-1) ? "hit" : "miss", stageHits, stageLaunches);
+#endif
+}
+
+/* Proof of play log: a fixed size record when omxplayer starts a file, and another when it stops. Records are queued
+ * in memory and a background thread appends them in batches, with one fdatasync per batch, so the main loop never
+ * waits for the disk; a crash loses at most the batch not yet synced. The log is a sequence of files
+ * playlog/NNNNNNNN.log of up to playLogSegment bytes. "xomxplayer --export-log [--json]" prints it.
+ */
+typedef struct {
+   unsigned int magic;
+   unsigned int type;      /* playStarted, playEnded */
+   long long start;        /* When omxplayer was started, CLOCK_REALTIME microseconds */
+   long long end;          /* When it stopped; 0 in a start record */
+   double pos;             /* Start position, seconds */
+   double played;          /* Position reached, seconds */
+   double duration;        /* Of the file, 0 if unknown */
+   int status;             /* omxplayer exit status, -signal; 0 in a start record */
+   int pauses, seeks, hides;  /* Interruptions */
+   unsigned int sum;       /* FNV-1a of the rest of the record */
+   char file[440];
+} XOMX_playrec;
+
+enum { playStarted=1, playEnded=2 };
+static const unsigned int playLogMagic=0x58504c31;
+static XOMX_playrec playQueue[256];
+static unsigned int playQueued, playDropped;
+static int playLogStopping, playLogFd=-1;
+static unsigned int playLogSeg;
+static pthread_t playLogThread;
+static pthread_mutex_t playLogLock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t playLogWake=PTHREAD_COND_INITIALIZER;
+
+static unsigned int playRecSum(const XOMX_playrec *r) {
+   const unsigned char *p=(const unsigned char *)r;
+   unsigned int h=2166136261u;
+   size_t i;
+
+   for (i=0; i<sizeof(*r); i++) {
+      if (i < offsetof(XOMX_playrec, sum) || i >= offsetof(XOMX_playrec, sum)+sizeof(r->sum))
+         h=(h^p[i])*16777619u;
+   }
+   return h;
+}
+
+/* Open segment seg for appending; a record torn by a crash at its end is cut off */
+static int playLogOpen(unsigned int seg) {
+   char name[32], path[4200];
+   struct stat st;
+   int fd;
+
+   snprintf(name, sizeof(name), "playlog/%08u.log", seg);
+   if (cachePath(path, sizeof(path), "playlog") || (mkdir(path, 0755) && errno!=EEXIST) ||
+         cachePath(path, sizeof(path), name) || (fd=open(path, O_WRONLY | O_CREAT | O_APPEND, 0644))==-1)
+      return -1;
+   if (fstat(fd, &st)==0 && st.st_size%sizeof(XOMX_playrec))
+      ftruncate(fd, st.st_size-st.st_size%sizeof(XOMX_playrec));
+   if (seg >= (unsigned int)playLogSegments) {   /* Drop the oldest kept */
+      snprintf(name, sizeof(name), "playlog/%08u.log", seg-playLogSegments);
+      if (cachePath(path, sizeof(path), name)==0)
+         unlink(path);
+   }
+   playLogSeg=seg;
+   return fd;
+}
+
+static void *playLogWorker(void *arg) {
+   static XOMX_playrec batch[LENGTH(playQueue)];
+   struct timespec until;
+   struct stat st;
+   unsigned int n, dropped;
+   int stopping;
+
+   pthread_mutex_lock(&playLogLock);
+   for (;;) {
+      while (playQueued==0 && !playLogStopping)
+         pthread_cond_wait(&playLogWake, &playLogLock);
+      /* Group commit: collect for up to playLogBatchMs, unless the queue is filling up or we're stopping */
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec+=playLogBatchMs/1000;
+      until.tv_nsec+=(playLogBatchMs%1000)*1000000L;
+      if (until.tv_nsec >= 1000000000L) {
+         until.tv_sec++;
+         until.tv_nsec-=1000000000L;
+      }
+      while (!playLogStopping && playQueued < LENGTH(playQueue)/2 &&
+            pthread_cond_timedwait(&playLogWake, &playLogLock, &until)!=ETIMEDOUT);
+      n=playQueued;
+      memcpy(batch, playQueue, n*sizeof(XOMX_playrec));
+      playQueued=0;
+      dropped=playDropped;
+      playDropped=0;
+      stopping=playLogStopping;
+      pthread_mutex_unlock(&playLogLock);
+
+      if (playLogFd!=-1 && fstat(playLogFd, &st)==0 && st.st_size >= playLogSegment) {
+         close(playLogFd);
+         playLogFd=playLogOpen(playLogSeg+1);
+      }
+      if (n > 0 && (playLogFd==-1 || write(playLogFd, batch, n*sizeof(XOMX_playrec))!=(ssize_t)(n*sizeof(XOMX_playrec))))
+         fprintf(stderr, "Play log: %u records not written.\n", n);
+      else if (n > 0)
+         fdatasync(playLogFd);
+      if (dropped)
+         fprintf(stderr, "Play log: queue full, %u records dropped.\n", dropped);
+      if (stopping)
+         return NULL;
+      pthread_mutex_lock(&playLogLock);
+   }
+}
+
+/* Find the newest segment and start the writer */
+static void playLogStart(void) {
+   char path[4200];
+   glob_t g;
+   unsigned int seg=0;
+
+   if (!playLog || cachePath(path, sizeof(path), "playlog/*.log"))
+      return;
+   if (glob(path, 0, NULL, &g)==0) {   /* Sorted: the last is the newest */
+      sscanf(strrchr(g.gl_pathv[g.gl_pathc-1], '/')+1, "%u", &seg);
+      globfree(&g);
+   }
+   playLogStopping=0;
+   if ((playLogFd=playLogOpen(seg))!=-1 && pthread_create(&playLogThread, NULL, playLogWorker, NULL)) {
+      close(playLogFd);
+      playLogFd=-1;
+   }
+}
+
+/* Write out what is queued and stop the writer */
+static void playLogStop(void) {
+   if (playLogFd==-1)
+      return;
+   pthread_mutex_lock(&playLogLock);
+   playLogStopping=1;
+   pthread_cond_signal(&playLogWake);
+   pthread_mutex_unlock(&playLogLock);
+   pthread_join(playLogThread, NULL);
+   close(playLogFd);
+   playLogFd=-1;
+}
+
+/* Queue r; never waits for the disk */
+static void playLogAdd(XOMX_playrec *r) {
+   if (playLogFd==-1)
+      return;
+   r->magic=playLogMagic;
+   r->sum=playRecSum(r);
+   pthread_mutex_lock(&playLogLock);
+   if (playQueued < LENGTH(playQueue)) {
+      memcpy(&playQueue[playQueued++], r, sizeof(*r));   /* With the padding the checksum covers */
+      pthread_cond_signal(&playLogWake);
+   }
+   else
+      playDropped++;
+   pthread_mutex_unlock(&playLogLock);
+}
+
+/* Print the play log as CSV, or JSON lines. Returns the exit status */
+static int playLogExport(int json) {
+   char path[4200], file[sizeof(((XOMX_playrec *)0)->file)*6+1], *o;
+   XOMX_playrec r;
+   glob_t g;
+   size_t i, j;
+   int fd;
+
+   if (cachePath(path, sizeof(path), "playlog/*.log") || glob(path, 0, NULL, &g)) {
+      fprintf(stderr, "No play log.\n");
+      return 1;
+   }
+   if (!json)
+      printf("type,file,start,end,position,played,duration,completion,status,pauses,seeks,hides\n");
+   for (i=0; i<g.gl_pathc; i++) {
+      if ((fd=open(g.gl_pathv[i], O_RDONLY))==-1)
+         continue;
+      while (read(fd, &r, sizeof(r))==sizeof(r)) {
+         if (r.magic!=playLogMagic || r.sum!=playRecSum(&r))
+            continue;   /* Damaged */
+         r.file[sizeof(r.file)-1]='\0';
+         for (j=0, o=file; r.file[j]; j++) {   /* Quote for CSV ("") or JSON (\", control characters as \u00XX) */
+            if (json && (unsigned char)r.file[j] < 0x20) {
+               o+=sprintf(o, "\\u%04x", (unsigned char)r.file[j]);
+               continue;
+            }
+            if (r.file[j]=='"' || (json && r.file[j]=='\\'))
+               *o++=json ? '\\' : '"';
+            *o++=r.file[j];
+         }
+         *o='\0';
+         if (json)
+            printf("{\"type\":\"%s\",\"file\":\"%s\",\"start\":%lld.%06lld,\"end\":%lld.%06lld,\"position\":%.3f,\"played\":%.3f,"
+               "\"duration\":%.3f,\"completion\":%.3f,\"status\":%i,\"pauses\":%i,\"seeks\":%i,\"hides\":%i}\n",
+               (r.type==playStarted) ? "start" : "end", file, r.start/1000000, r.start%1000000, r.end/1000000, r.end%1000000,
+               r.pos, r.played, r.duration, (r.duration > 0) ? r.played/r.duration : 0, r.status, r.pauses, r.seeks, r.hides);
+         else
+            printf("%s,\"%s\",%lld.%06lld,%lld.%06lld,%.3f,%.3f,%.3f,%.3f,%i,%i,%i,%i\n", (r.type==playStarted) ? "start" : "end", file,
+               r.start/1000000, r.start%1000000, r.end/1000000, r.end%1000000, r.pos, r.played, r.duration,
+               (r.duration > 0) ? r.played/r.duration : 0, r.status, r.pauses, r.seeks, r.hides);
+      }
+      close(fd);
+   }
+   globfree(&g);
+   return 0;
+}
+
+static unsigned long playerStarts, playerKills;
+
+/* Queue a proof of play record for sourceFile; status is omxplayer's exit status, -signal */
+static void playLogged(unsigned int type, int status) {
+   XOMX_playrec r;
+
+   memset(&r, 0, sizeof(r));
+   r.type=type;
+   r.start=playStartReal;
+   r.pos=playStartPos;
+   r.played=playStartPos;
+   r.duration=probe.duration;
+   if (type==playEnded) {
+      r.end=realUs();
+      r.played=playPosition();
+      if (probe.duration > 0 && r.played > probe.duration)
+         r.played=probe.duration;
+      r.status=status;
+   }
+   r.pauses=playPauses;
+   r.seeks=playSeeks;
+   r.hides=playHides;
+   snprintf(r.file, sizeof(r.file), "%.439s", sourceFile);
+   playLogAdd(&r);
+}
+
+/* omxplayer_pid has been started at pos seconds */
+static void playerBegan(double pos) {
+   playerStart=nowUs();
+   playerReady=0;
+   playerStarts++;
+   playPos=pos;
+   playAnchor=realUs();
+   playPaused=0;
+   playStartReal=playAnchor;
+   playStartPos=pos;
+   playPauses=playSeeks=playHides=0;
+   if (omxplayer_pid > 0)
+      playLogged(playStarted, 0);
+}
+
+/* Start omxplayer on sourceFile, or its staged copy, at pos seconds */
+static void startPlayer(double pos) {
+   if (playlist!=NULL && !strcmp(sourceFile, playlist[playlistCur]))   /* Only playlist items are staged, not renditions */
+      stageUse(playlistCur);
+   buildPlayerArgs(pos);
+   if (stageFd!=-1 && !strncmp(videoFile, "/proc/self/fd/", 14))
+      fcntl(stageFd, F_SETFD, 0);   /* Inherited by omxplayer only */
+   omxplayer_pid=spawn(playerArgs);
+   if (stageFd!=-1)
+      fcntl(stageFd, F_SETFD, FD_CLOEXEC);
+   playerBegan(pos);
+}
+
+/* Wait for omxplayer to finish after quit_player. If it doesn't return within 3 seconds send SIGTERM, then SIGKILL. */
+static void stopPlayer(void) {
+   pid_t chld_pid=0;
+   int chld_status;
+   int i=0;
+
+   while (i<3) {  /* Wait for omxplayer to finish */
+      chld_pid=waitpid(omxplayer_pid, &chld_status, WNOHANG);
+      if (chld_pid > 0)
+         break;
+      else
+         sleep(1);
+      i++;
+   }
+
+   if (chld_pid != omxplayer_pid) { /* Looks like omxplayer is not responding to dbus control, send TERM signal */
+      fprintf(stderr, "ERROR: xomxplayer: omxplayer not responding, sending SIGTERM.\n");
+      playerKills++;
+      kill(omxplayer_pid, SIGTERM);
+      sleep(1);
+      chld_pid=waitpid(omxplayer_pid, &chld_status, WNOHANG);
+      if (chld_pid != omxplayer_pid) {/* SIGTERM ignored, try SIGKILL */
+         fprintf(stderr, "ERROR: xomxplayer: SIGTERM ignored, sending SIGKILL.\n");
+         kill(omxplayer_pid, SIGKILL);
+         sleep(1);
+         chld_pid=waitpid(omxplayer_pid, &chld_status, WNOHANG);
+         if (chld_pid != omxplayer_pid)
+            fprintf(stderr, "ERROR: xomxplayer: Can't stop omxplayer!\n");
+      }
+   }
+   if (chld_pid==omxplayer_pid)
+      childExited(chld_status);
+   playLogged(playEnded, (chld_pid!=omxplayer_pid) ? -SIGKILL :
+      WIFEXITED(chld_status) ? WEXITSTATUS(chld_status) : -WTERMSIG(chld_status));
+   omxplayer_pid=0;
+}
+
+/* Replacing omxplayer without waiting for it: playerQuit() sends Quit and playerReplace() says what to start once it
+ * has gone. omxplayer_pid stays the old player until then, and the main loop's reaper calls replaceReaped(), which
+ * starts the new one; replaceRun() kills the old one if it hasn't gone within 3 seconds.
+ */
+static pid_t replacePid;        /* omxplayer quitting to be replaced, 0 if none */
+static long long replaceAt;     /* When it was told to quit, -1 once killed */
+static int replaceStart;        /* Start sourceFile once it has gone */
+static double replacePos;       /* There, -1 for where the old one had got to */
+static int replaceEnded;        /* The old one's play record has been closed */
+
+/* Tell omxplayer to quit. With ended its play record is closed now, as sourceFile is about to change */
+static void playerQuit(int ended) {
+   if (omxplayer_pid <= 0 || replacePid > 0)
+      return;
+   if (ended)
+      playLogged(playEnded, 0);
+   spawn(quit_player);
+   replacePid=omxplayer_pid;
+   replaceAt=nowUs();
+   replaceStart=0;
+   replacePos=-1;
+   replaceEnded=ended;
+}
+
+/* Start sourceFile at pos (-1: where the player had got to): now, or once the player quitting has gone */
+static void playerReplace(double pos) {
+   if (replacePid > 0) {
+      replaceStart=1;
+      replacePos=pos;
+      return;
+   }
+   startPlayer((pos > 0) ? pos : 0);
+}
+
+/* A child has been reaped. Returns 1 if it was the player being replaced and the new one couldn't be started */
+static int replaceReaped(pid_t chld_pid, int status) {
+   double pos;
+
+   if (replacePid <= 0 || chld_pid!=replacePid)
+      return 0;
+   replacePid=0;
+   if (chld_pid!=omxplayer_pid)
+      return 0;   /* Superseded */
+   if (!replaceStart) {   /* Only quit */
+      omxplayer_pid=0;
+      return 0;
+   }
+   pos=(replacePos >= 0) ? replacePos : playPosition();
+   if (replacePos < 0 && probe.duration > 0 && pos >= probe.duration)
+      return 0;   /* Got to the end meanwhile: ends as it would have */
+   if (!replaceEnded)   /* The same item, restarted */
+      playLogged(playEnded, WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+   startPlayer(pos);
+   if (omxplayer_pid < 1) {
+      omxplayer_pid=0;
+      return 1;
+   }
+   return 0;
+}
+
+/* Returns microseconds until the player being replaced is due to be killed, -1 if none is */
+static long long replaceRun(void) {
+   long long left;
+
+   if (replacePid <= 0 || replaceAt < 0)
+      return -1;
+   if ((left=replaceAt+3000000-nowUs()) > 0)
+      return left;
+   fprintf(stderr, "ERROR: xomxplayer: omxplayer not responding, sending SIGKILL.\n");
+   kill(replacePid, SIGKILL);
+   playerKills++;
+   replaceAt=-1;
+   return -1;
+}
+
+/* Read a small file (/proc) into buf, '\0' terminated, without stdio. Returns the length, -1 on error */
+static ssize_t readSmall(const char *path, char *buf, size_t len) {
+   ssize_t n;
+   int fd;
+
+   if ((fd=open(path, O_RDONLY))==-1)
+      return -1;
+   n=read(fd, buf, len-1);
+   close(fd);
+   buf[(n > 0) ? n : 0]='\0';
+   return n;
+}
+
+/* CPU seconds and resident memory (kB) used so far by process p. Returns 0 on success */
+static int playerUsage(pid_t p, double *cpu, long *rss) {
+   char path[64], buf[4096], *c;
+   unsigned long utime, stime;
+
+   snprintf(path, sizeof(path), "/proc/%i/stat", p);
+   if (readSmall(path, buf, sizeof(buf)) <= 0 || (c=strrchr(buf, ')'))==NULL ||  /* Skip pid and (comm) */
+         sscanf(c+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime)!=2)
+      return 1;
+   *cpu=(double)(utime+stime)/sysconf(_SC_CLK_TCK);
+   *rss=0;
+   snprintf(path, sizeof(path), "/proc/%i/status", p);
+   if (readSmall(path, buf, sizeof(buf)) > 0 && (c=strstr(buf, "\nVmRSS:"))!=NULL)
+      sscanf(c+7, "%ld", rss);
+   return 0;
+}
+
+/* Renditions: other encodings of sourceFile found next to it, named <name>.<height>p.<ext>
+ * (e.g. film.mp4, film.720p.mp4, film.360p.mp4). renditions[0] is the file given.
+ */
+typedef struct {
+   char file[4096];
+   XOMX_probe info;
+} XOMX_rendition;
+
+static XOMX_rendition renditions[8];
+static int renditionCount, renditionCur;
+static long long renditionSwitched;   /* Time of the last switch */
+
+/* Copy s to buf with the glob(3) metacharacters escaped */
+static void globEscape(char *buf, size_t len, const char *s) {
+   size_t n=0;
+
+   for (; *s && n+2 < len; s++) {
+      if (strchr("*?[]\\", *s))
+         buf[n++]='\\';
+      buf[n++]=*s;
+   }
+   buf[n]='\0';
+}
+
+static void findRenditions(const char *file) {
+   char pattern[4200], base[4096], globBase[8192], globExt[512];
+   const char *ext, *tag;
+   glob_t g;
+   size_t i;
+
+   snprintf(renditions[0].file, sizeof(renditions[0].file), "%s", file);
+   renditions[0].info=probe;
+   renditionCount=1;
+   ext=strrchr(file, '.');
+   if (ext==NULL || strchr(ext, '/'))
+      return;
+   snprintf(base, sizeof(base), "%.*s", (int)(ext-file), file);
+   if ((tag=strrchr(base, '.'))!=NULL && tag[1]>='0' && tag[1]<='9' && base[strlen(base)-1]=='p')
+      base[tag-base]='\0';  /* file is itself a rendition */
+   snprintf(pattern, sizeof(pattern), "%s%s", base, ext);   /* The untagged name, if file is tagged */
+   if (strcmp(pattern, file) && probeFile(pattern, &renditions[renditionCount].info)==0)
+      snprintf(renditions[renditionCount++].file, sizeof(renditions[0].file), "%.4000s", pattern);
+   globEscape(globBase, sizeof(globBase), base);
+   globEscape(globExt, sizeof(globExt), ext);
+   snprintf(pattern, sizeof(pattern), "%.4000s.*[0-9]p%.190s", globBase, globExt);
+   if (glob(pattern, 0, NULL, &g)==0) {
+      for (i=0; i<g.gl_pathc && renditionCount<(int)LENGTH(renditions); i++) {
+         if (!strcmp(g.gl_pathv[i], file))
+            continue;
+         snprintf(renditions[renditionCount].file, sizeof(renditions[0].file), "%s", g.gl_pathv[i]);
+         if (probeFile(g.gl_pathv[i], &renditions[renditionCount].info)==0)
+            renditionCount++;
+      }
+      globfree(&g);
+   }
+#ifdef DEBUG
+   fprintf(stderr, "%i renditions of %s\n", renditionCount, file);
+#endif
+}
+
+/* Scale omxplayer applies to rendition r in a w x h (hdmi pixels) letterboxed video rectangle */
+static double renditionScale(int r, unsigned int w, unsigned int h) {
+   double sw=(double)w/renditions[r].info.width;
+   double sh=(double)h/renditions[r].info.height;
+
+   return (sw < sh) ? sw : sh;
+}
+
+/* Switch to the smallest rendition which isn't scaled up in a w x h video rectangle, restarting omxplayer
+ * at the current position (playerReplace(): it is started once the old one has gone). To stop flapping around a threshold, a smaller rendition is only chosen if it
+ * would still be scaled down by 15%, a larger one only if the current one would be scaled up by 15%, and
+ * there is at most one switch every renditionHoldMs. Returns 1 if omxplayer was restarted.
+ */
+static int switchRendition(unsigned int w, unsigned int h) {
+   int i, best=-1;
+   double cpu=0, scale;
+   long rss=0;
+
+   if (renditionCount < 2 || nowUs()-renditionSwitched < renditionHoldMs*1000LL || replacePid > 0)
+      return 0;
+   scale=renditionScale(renditionCur, w, h);
+   for (i=0; i<renditionCount; i++) {
+      if (renditionScale(i, w, h) <= ((i==renditionCur) ? 1.15 : 0.85) &&
+            (best==-1 || renditions[i].info.width*renditions[i].info.height < renditions[best].info.width*renditions[best].info.height))
+         best=i;
+   }
+   if (best==-1) {   /* All are scaled up: use the largest, if the current is noticeably scaled up */
+      if (scale <= 1.15)
+         return 0;
+      for (i=0, best=0; i<renditionCount; i++) {
+         if (renditions[i].info.width*renditions[i].info.height > renditions[best].info.width*renditions[best].info.height)
+            best=i;
+      }
+   }
+   if (best==renditionCur)
+      return 0;
+
+   playerUsage(omxplayer_pid, &cpu, &rss);
+#ifdef DEBUG
+   fprintf(stderr, "Rendition %ix%i: %.0f%% CPU, %ld kB resident. Switching to %ix%i at %.1fs.\n",
+      renditions[renditionCur].info.width, renditions[renditionCur].info.height, 100*cpu/((nowUs()-playerStart)/1e6), rss,
+      renditions[best].info.width, renditions[best].info.height, playPosition());
+#endif
+   playerQuit(1);
+   renditionCur=best;
+   renditionSwitched=nowUs();
+   snprintf(sourceFile, sizeof(sourceFile), "%s", renditions[best].file);
+   snprintf(videoFile, sizeof(videoFile), "%s", renditions[best].file);
+   probe=renditions[best].info;
+   playerReplace(-1);   /* Where the old one has got to when it goes: the position follows the wall clock until then */
+   return 1;
+}
+
+/* Make item the playing file: probe it and find its renditions */
+static void loadItem(int item) {
+   pthread_mutex_lock(&stageLock);
+   playlistCur=item;
+   pthread_cond_signal(&stageWake);   /* The staging window has moved on */
+   pthread_mutex_unlock(&stageLock);
+   snprintf(sourceFile, sizeof(sourceFile), "%s", playlist[item]);
+   snprintf(videoFile, sizeof(videoFile), "%s", playlist[item]);
+   probeFile(sourceFile, &probe);
+   findRenditions(sourceFile);
+   renditionCur=0;
+}
+
+#ifdef XOMX_SNAP
+/* Resize step in hdmi pixels: 1/XOMX_SNAP of the source size */
+static void snapStep(int *incw, int *inch) {
+   *incw=(renditions[0].info.width > 0) ? renditions[0].info.width : 1920;
+   *inch=(renditions[0].info.height > 0) ? renditions[0].info.height : 1080;
+   *incw=(*incw+XOMX_SNAP/2)/XOMX_SNAP;
+   *inch=(*inch+XOMX_SNAP/2)/XOMX_SNAP;
+   if (*incw < 1)
+      *incw=1;
+   if (*inch < 1)
+      *inch=1;
+}
+
+/* Shrink the video rectangle (hdmi pixels) to the largest whole number of resize steps which fits, keeping
+ * the source aspect, and centre it in the original rectangle.
+ */
+static void snapRect(int *x, int *y, unsigned int *w, unsigned int *h) {
+   int incw, inch;
+   unsigned int k, kh;
+
+   snapStep(&incw, &inch);
+   k=*w/incw;
+   kh=*h/inch;
+   if (kh < k)
+      k=kh;
+   if (k < 1)
+      return;  /* Smaller than one step, leave it alone */
+   *x+=(*w-k*incw)/2;
+   *y+=(*h-k*inch)/2;
+   *w=k*incw;
+   *h=k*inch;
+}
+#endif
+
+static void xhints(float sx, float sy) {
+   XClassHint class = {className, className};
+   XWMHints wm = {.flags = InputHint, .input = 1};
+   XSizeHints *sizeh = NULL;
+
+   sizeh = XAllocSizeHints();
+   sizeh->flags = PSize | PMinSize | PMaxSize ;
+   sizeh->height = (int)(576*sx);
+   sizeh->width = (int)(1024*sy);
+   sizeh->min_width=(int)(320*sx);
+   sizeh->min_height=(int)(240*sy);
+   sizeh->max_width=(int)(1920*sx);
+   sizeh->max_height=(int)(1080*sy);
+   if (geomGiven) {   /* Ask the window manager to keep the restored geometry */
+      sizeh->flags |= USPosition | USSize;
+      sizeh->x=geom.x;
+      sizeh->y=geom.y;
+      sizeh->width=geom.w;
+      sizeh->height=geom.h;
+   }
+#ifdef XOMX_SNAP
+   if (tileCount==0) {   /* A mosaic has no one source size */
+      int incw, inch;
+
+      snapStep(&incw, &inch);
+      sizeh->flags |= PResizeInc | PAspect | PBaseSize;
+      sizeh->base_width=0;
+      sizeh->base_height=0;
+      sizeh->width_inc=(int)(incw*sx+0.5);
+      sizeh->height_inc=(int)(inch*sy+0.5);
+      sizeh->min_aspect.x=sizeh->max_aspect.x=(int)(incw*XOMX_SNAP*sx+0.5);   /* X pixels, which aren't square if sx!=sy */
+      sizeh->min_aspect.y=sizeh->max_aspect.y=(int)(inch*XOMX_SNAP*sy+0.5);
+   }
+#endif
+
+   XSetWMProperties(dis, win, NULL, NULL, NULL, 0, sizeh, &wm, &class);
+   XFree(sizeh);
+}
+
+/* Poster frame, shown in win while omxplayer starts */
+static XImage *poster;
+static XShmSegmentInfo posterShm;
+static GC posterGC;
+static int posterShown;
+static long long posterStart;   /* When the poster was first drawn, for the startup time */
+static const long posterMax=16384;   /* Largest PPM width or height taken */
+static int posterShmFailed;
+
+static int posterShmError(Display *d, XErrorEvent *e) {
+   posterShmFailed=1;
+   return 0;
+}
+
+/* Parse a binary PPM (P6, maxval 255) header. Returns a pointer to the pixels or NULL, also if it is larger than
+ * posterMax on a side.
+ */
+static const unsigned char *ppmPixels(const unsigned char *p, size_t len, int *w, int *h) {
+   const unsigned char *end=p+len;
+   long v[3];
+   int i;
+
+   if (len < 3 || p[0]!='P' || p[1]!='6')
+      return NULL;
+   p+=2;
+   for (i=0; i<3; i++) {
+      while (p < end && (*p==' ' || *p=='\t' || *p=='\n' || *p=='\r' || *p=='#')) {
+         if (*p=='#')
+            while (p < end && *p!='\n')
+               p++;
+         else
+            p++;
+      }
+      for (v[i]=0; p < end && *p>='0' && *p<='9' && v[i] < 100000; p++)
+         v[i]=v[i]*10+(*p-'0');
+   }
+   if (p >= end || v[0] < 1 || v[1] < 1 || v[0] > posterMax || v[1] > posterMax || v[2]!=255 ||
+         (unsigned long long)(end-p-1) < (unsigned long long)v[0]*v[1]*3)
+      return NULL;
+   *w=v[0];
+   *h=v[1];
+   return p+1;   /* One whitespace after maxval */
+}
+
+/* Fill poster (w x h, 32 bit 0x00RRGGBB) from the cache, or scale the PPM into it and save it to the cache.
+ * The image is letterboxed on black. Returns 0 on success.
+ */
+static int posterPixels(const char *ppm, unsigned int *out, int w, int h) {
+   char cache[4096], name[64], path[PATH_MAX], tmp[4112];
+   const unsigned char *pix, *src, *px;
+   unsigned char *map;
+   unsigned long long hash=14695981039346656037ULL;  /* FNV-1a of path and mtime */
+   struct stat st;
+   int fd, cfd, pw, ph, x, y, dw, dh, ox, oy;
+   ssize_t n;
+   char *c;
+   glob_t g;
+   size_t i;
+
+   fd=open(ppm, O_RDONLY);
+   if (fd==-1)
+      return 1;
+   if (fstat(fd, &st) || realpath(ppm, path)==NULL) {
+      close(fd);
+      return 1;
+   }
+   for (c=path; *c; c++)
+      hash=(hash^(unsigned char)*c)*1099511628211ULL;
+   hash=(hash^(unsigned long long)st.st_mtime)*1099511628211ULL;
+   snprintf(name, sizeof(name), "posters/%016llx-%ix%i", hash, w, h);
+   if (cachePath(cache, sizeof(cache), "posters")==0) {
+      mkdir(cache, 0755);
+      cachePath(cache, sizeof(cache), name);
+      n=-1;
+      if ((cfd=open(cache, O_RDONLY))!=-1) {
+         n=read(cfd, out, (size_t)w*h*4);
+         close(cfd);
+      }
+      if (n==(ssize_t)w*h*4) {
+         close(fd);
+         return 0;
+      }
+   }
+   else
+      cache[0]='\0';
+
+   map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map==MAP_FAILED)
+      return 1;
+   if ((pix=ppmPixels(map, st.st_size, &pw, &ph))==NULL) {
+      munmap(map, st.st_size);
+      return 1;
+   }
+   /* Nearest neighbour, keeping the aspect */
+   if ((long long)w*ph <= (long long)h*pw) {
+      dw=w;
+      dh=(long long)w*ph/pw;
+   }
+   else {
+      dh=h;
+      dw=(long long)h*pw/ph;
+   }
+   ox=(w-dw)/2;
+   oy=(h-dh)/2;
+   memset(out, 0, (size_t)w*h*4);
+   for (y=0; y<dh; y++) {
+      src=pix+(size_t)((long long)y*ph/dh)*pw*3;
+      for (x=0; x<dw; x++) {
+         px=src+(size_t)((long long)x*pw/dw)*3;
+         out[(size_t)(y+oy)*w+x+ox]=(unsigned int)px[0]<<16 | (unsigned int)px[1]<<8 | px[2];
+      }
+   }
+   munmap(map, st.st_size);
+
+   if (cache[0]) {   /* Only the latest size of a poster is kept */
+      snprintf(name, sizeof(name), "posters/%016llx-*", hash);
+      if (cachePath(tmp, sizeof(tmp), name)==0 && glob(tmp, 0, NULL, &g)==0) {
+         for (i=0; i<g.gl_pathc; i++)
+            unlink(g.gl_pathv[i]);
+         globfree(&g);
+      }
+      snprintf(tmp, sizeof(tmp), "%s.%i", cache, getpid());
+      if ((fd=open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644))!=-1) {
+         n=write(fd, out, (size_t)w*h*4);
+         if (close(fd) || n!=(ssize_t)w*h*4 || rename(tmp, cache))
+            unlink(tmp);
+      }
+   }
+   return 0;
+}
+
+static void freePoster(void) {
+   if (poster==NULL)
+      return;
+   if (posterShm.shmaddr) {
+      XShmDetach(dis, &posterShm);
+      poster->data=NULL;
+      XDestroyImage(poster);
+      shmdt(posterShm.shmaddr);
+      posterShm.shmaddr=NULL;
+   }
+   else
+      XDestroyImage(poster);
+   poster=NULL;
+}
+
+static void drawPoster(void) {
+   if (poster==NULL)
+      return;
+   if (posterShm.shmaddr)
+      XShmPutImage(dis, win, posterGC, poster, 0, 0, 0, 0, poster->width, poster->height, False);
+   else
+      XPutImage(dis, win, posterGC, poster, 0, 0, 0, 0, poster->width, poster->height);
+}
+
+/* Show the poster for sourceFile at the window size. Only 24 bit TrueColor visuals with the usual masks are handled */
+static void showPoster(void) {
+   char ppm[4200];
+   const char *ext=strrchr(sourceFile, '.');
+   Visual *vis=DefaultVisual(dis, DefaultScreen(dis));
+   int depth=DefaultDepth(dis, DefaultScreen(dis));
+   long long t=nowUs();
+   unsigned int *pixels;
+   XErrorHandler old;
+   int y;
+
+   freePoster();
+   if (depth!=24 || vis->red_mask!=0xff0000 || vis->green_mask!=0xff00 || vis->blue_mask!=0xff || geom.w < 1 || geom.h < 1)
+      return;
+   snprintf(ppm, sizeof(ppm), "%.*s.ppm", (ext && !strchr(ext, '/')) ? (int)(ext-sourceFile) : (int)strlen(sourceFile), sourceFile);
+   if (access(ppm, R_OK))
+      return;
+   if (posterGC==NULL)
+      posterGC=XCreateGC(dis, win, 0, NULL);
+   if (XShmQueryExtension(dis)) {
+      poster=XShmCreateImage(dis, vis, depth, ZPixmap, NULL, &posterShm, geom.w, geom.h);
+      if (poster!=NULL) {
+         posterShm.shmid=shmget(IPC_PRIVATE, (size_t)poster->bytes_per_line*poster->height, IPC_CREAT | 0600);
+         posterShm.shmaddr=(posterShm.shmid==-1) ? (char *)-1 : shmat(posterShm.shmid, NULL, 0);
+         if (posterShm.shmaddr==(char *)-1) {
+            if (posterShm.shmid!=-1)
+               shmctl(posterShm.shmid, IPC_RMID, NULL);
+            posterShm.shmaddr=NULL;
+            XDestroyImage(poster);
+            poster=NULL;
+         }
+         else {
+            poster->data=posterShm.shmaddr;
+            posterShm.readOnly=True;
+            posterShmFailed=0;
+            old=XSetErrorHandler(posterShmError);   /* e.g. a server in another IPC namespace */
+            XShmAttach(dis, &posterShm);
+            XSync(dis, False);
+            XSetErrorHandler(old);
+            shmctl(posterShm.shmid, IPC_RMID, NULL);   /* Freed when both sides detach */
+            if (posterShmFailed) {
+               poster->data=NULL;
+               XDestroyImage(poster);
+               poster=NULL;
+               shmdt(posterShm.shmaddr);
+               posterShm.shmaddr=NULL;
+            }
+         }
+      }
+   }
+   if (poster==NULL) {   /* No MIT-SHM, e.g. a remote display */
+      poster=XCreateImage(dis, vis, depth, ZPixmap, 0, malloc((size_t)geom.w*geom.h*4), geom.w, geom.h, 32, 0);
+      if (poster==NULL)
+         return;
+      if (poster->data==NULL) {
+         XDestroyImage(poster);
+         poster=NULL;
+         return;
+      }
+   }
+   pixels=malloc((size_t)geom.w*geom.h*4);
+   if (pixels==NULL || poster->bits_per_pixel!=32 || posterPixels(ppm, pixels, geom.w, geom.h)) {
+      free(pixels);
+      freePoster();
+      return;
+   }
+   for (y=0; y<geom.h; y++)
+      memcpy(poster->data+(size_t)y*poster->bytes_per_line, pixels+(size_t)y*geom.w, (size_t)geom.w*4);
+   free(pixels);
+   XSelectInput(dis, win, KeyPressMask | StructureNotifyMask | VisibilityChangeMask | PropertyChangeMask | ExposureMask);
+   drawPoster();
+   XFlush(dis);
+   if (!posterShown)
+      posterStart=t;
+   posterShown=1;
+#ifdef DEBUG
+   fprintf(stderr, "Poster %s at %ix%i in %lli us.\n", ppm, geom.w, geom.h, nowUs()-t);
+#endif
+}
+
+/* omxplayer is showing video: drop the poster and go back to not handling Expose */
+static void hidePoster(void) {
+   freePoster();
+   XSelectInput(dis, win, KeyPressMask | StructureNotifyMask | VisibilityChangeMask | PropertyChangeMask);
+   posterShown=0;
+}
+
+/* Tell a compositor the whole window is opaque, so it doesn't blend what is underneath.
+ * Called when the size changes; the region is in window coordinates.
+ */
+static void setOpaqueRegion(unsigned int w, unsigned int h) {
+   long region[4]={ 0, 0, w, h };
+
+   XChangeProperty(dis, win, netOpaqueRegion, XA_CARDINAL, 32, PropModeReplace, (unsigned char *)region, 4);
+}
+
+/* Error handler for requests on windows which may have gone (a frame, an adopted win) */
+static int xBadWindow;
+
+static int xError(Display *d, XErrorEvent *e) {
+   xBadWindow=1;
+   return 0;
+}
+
+/* Update geom from a ConfigureNotify (of win or its frame), ReparentNotify or PropertyNotify event.
+ * Returns 1 if the root relative geometry of win may have changed.
+ */
+static int trackGeometry(XEvent *ev) {
+   Window root=DefaultRootWindow(dis);
+   Window child;
+   XErrorHandler old;
+   Atom type;
+   int format;
+   unsigned long n, after;
+   long *extents=NULL;
+
+   switch (ev->type) {
+   case ConfigureNotify:
+      if (ev->xconfigure.window==win) {
+         geom.w=ev->xconfigure.width;
+         geom.h=ev->xconfigure.height;
+         if (ev->xconfigure.send_event || geom.frame==None) {  /* Root coordinates */
+            geom.x=ev->xconfigure.x;
+            geom.y=ev->xconfigure.y;
+            if (geom.frame!=None) {
+               geom.frameX=geom.x-geom.offX;
+               geom.frameY=geom.y-geom.offY;
+            }
+            return 1;
+         }
+         geom.offX=ev->xconfigure.x;   /* Relative to the frame */
+         geom.offY=ev->xconfigure.y;
+      }
+      else if (ev->xconfigure.window==geom.frame) {
+         if (geom.frameX==ev->xconfigure.x+ev->xconfigure.border_width && geom.frameY==ev->xconfigure.y+ev->xconfigure.border_width)
+            return 0;   /* Restacked or resized in place; the size of win comes from its own event */
+         geom.frameBw=ev->xconfigure.border_width;
+         geom.frameX=ev->xconfigure.x+geom.frameBw;
+         geom.frameY=ev->xconfigure.y+geom.frameBw;
+      }
+      else
+         return 0;
+      break;
+   case ReparentNotify:
+      if (ev->xreparent.window!=win)
+         return 0;
+      /* Unmanaged (WM exit or restart, an unmap): the frame is usually destroyed by now, so it is left alone.
+       * Moved to another frame: the old one may have gone too, so a BadWindow mustn't take the default handler's exit.
+       */
+      if (geom.frame!=None && ev->xreparent.parent!=root) {
+         old=XSetErrorHandler(xError);
+         XSelectInput(dis, geom.frame, NoEventMask);
+         XSync(dis, False);
+         XSetErrorHandler(old);
+      }
+      if (ev->xreparent.parent==root) {
+         geom.frame=None;
+         geom.x=ev->xreparent.x;
+         geom.y=ev->xreparent.y;
+         return 1;
+      }
+      geom.frame=ev->xreparent.parent;
+      XSelectInput(dis, geom.frame, StructureNotifyMask);
+      geom.offX=ev->xreparent.x;
+      geom.offY=ev->xreparent.y;
+      if (!XTranslateCoordinates(dis, win, root, 0, 0, &geom.x, &geom.y, &child))
+         return 0;
+      geom.frameX=geom.x-geom.offX;
+      geom.frameY=geom.y-geom.offY;
+      return 1;
+   case PropertyNotify:
+      if (ev->xproperty.atom!=netFrameExtents || ev->xproperty.state!=PropertyNewValue || geom.frame==None)
+         return 0;
+      if (XGetWindowProperty(dis, win, netFrameExtents, 0, 4, False, XA_CARDINAL, &type, &format, &n, &after,
+            (unsigned char **)&extents)!=Success || extents==NULL)
+         return 0;
+      if (n==4) {   /* left, right, top, bottom */
+         geom.offX=extents[0]-geom.frameBw;
+         geom.offY=extents[2]-geom.frameBw;
+      }
+      XFree(extents);
+      break;
+   default:
+      return 0;
+   }
+   geom.x=geom.frameX+geom.offX;
+   geom.y=geom.frameY+geom.offY;
+   return 1;
+}
+
+/* Full screen on (action 1, _NET_WM_STATE_ADD), off (0) or toggled (2) */
+static void setFS(long action) {
+   XEvent fsToggle;
+   static int fs=0;
+   static XWindowAttributes saved;
+
+   if (overrideRedirect) {  /* No window manager to ask */
+      if (action!=2 && action==fs)
+         return;
+      if (!fs) {
+         XGetWindowAttributes(dis, win, &saved);
+         XMoveResizeWindow(dis, win, 0, 0, DisplayWidth(dis, DefaultScreen(dis)), DisplayHeight(dis, DefaultScreen(dis)));
+      }
+      else
+         XMoveResizeWindow(dis, win, saved.x, saved.y, saved.width, saved.height);
+      fs=!fs;
+      return;
+   }
+   memset(&fsToggle, 0, sizeof(fsToggle));
+   fsToggle.type = ClientMessage;
+   fsToggle.xclient.window = win;
+   fsToggle.xclient.message_type = XInternAtom(dis, "_NET_WM_STATE", False);
+   fsToggle.xclient.format = 32;
+   fsToggle.xclient.data.l[0] = action;
+   fsToggle.xclient.data.l[1] = XInternAtom(dis, "_NET_WM_STATE_FULLSCREEN", False);
+   fsToggle.xclient.data.l[2] = 0;
+   XSendEvent (dis, DefaultRootWindow(dis), False,
+   SubstructureRedirectMask | SubstructureNotifyMask, &fsToggle);
+}
+
+static void toggleFS() {
+   setFS(2);
+}
+
+/* Mosaic (-m <file>...): the files are played side by side in win, each by its own omxplayer on consecutive layers.
+ * Tile 0 is the usual player (omxplayer_pid, the playlist); the others are started and stopped with it, and a tile
+ * whose player ends stays empty. When the window settles the grid is worked out in one pass and every tile's VideoPos
+ * is sent at once. Tiles are letterboxed, or with mosaicCrop filled by cropping the source. tileFocusKey moves the
+ * keyboard focus: the keys act on the focused tile, whose file is shown as the window name. The window is closed when
+ * the last tile has finished, not with tile 0.
+ */
+typedef struct {
+   pid_t pid;           /* 0 if not running; tile 0 has omxplayer_pid, copied here by audioRun() */
+   int audio;           /* Started with audio decoding */
+   int muted;
+   long long quietSince;   /* When it stopped being heard, 0 if it is */
+   char file[4096];
+   XOMX_probe probe;
+   char dbus[128];
+   char dest[256];
+   char layer[16];
+   char win[32];        /* VideoPos rectangle */
+} XOMX_tile;
+
+static XOMX_tile tiles[16];
+static int tileFocus;
+static char tileVideo[4096];   /* videoFile, while a tile is started */
+static XOMX_tile tileSaved;
+static double tilePos[LENGTH(tiles)];         /* Playback position of the tiles after the first, as playPos */
+static long long tileAnchor[LENGTH(tiles)];   /* 0 if not known (adopted from an older binary) */
+static int tilePaused[LENGTH(tiles)];
+
+/* Playback position of tile i, seconds; -1 if it isn't known */
+static double tilePosition(int i) {
+   if (i==0)
+      return playPosition();
+   if (tileAnchor[i]==0)
+      return -1;
+   return tilePos[i]+(tilePaused[i] ? 0 : (realUs()-tileAnchor[i])/1e6);
+}
+
+/* Re-anchor tile i after a seek of delta seconds, or a pause toggle, as playMark() does tile 0 */
+static void tileMark(int i, double delta, int pause) {
+   if (tileAnchor[i]==0)
+      return;
+   tilePos[i]=tilePosition(i)+delta;
+   if (tilePos[i] < 0)
+      tilePos[i]=0;
+   tileAnchor[i]=realUs();
+   tilePaused[i]^=pause;
+}
+
+/* Take the files after the first, which is tile 0 */
+static void mosaicInit(char **files, int n) {
+   int i;
+
+   tileCount=1;
+   for (i=0; i<n && tileCount<(int)LENGTH(tiles); i++, tileCount++) {
+      snprintf(tiles[tileCount].file, sizeof(tiles[tileCount].file), "%s", files[i]);
+      probeFile(files[i], &tiles[tileCount].probe);
+   }
+   if (i < n)
+      fprintf(stderr, "Mosaic: %i files not shown, %i tiles at most.\n", n-i, (int)LENGTH(tiles));
+}
+
+/* dbus names and layers, after initNames() */
+static void mosaicNames(void) {
+   int i;
+
+   snprintf(tiles[0].dest, sizeof(tiles[0].dest), "%s", destParam);
+   for (i=1; i<tileCount; i++) {
+      snprintf(tiles[i].dbus, sizeof(tiles[i].dbus), "%.100s_%i", dbusParam, i);
+      snprintf(tiles[i].dest, sizeof(tiles[i].dest), "--dest=%.100s_%i", dbusParam, i);
+      snprintf(tiles[i].layer, sizeof(tiles[i].layer), "%i", atoi(layerParam)+i);
+   }
+}
+
+/* Swap tile t's names, rectangle, file and probe with the globals the player commands use. Twice puts them back */
+static void tileSwap(XOMX_tile *t) {
+   tileSaved=*t;
+   snprintf(t->dbus, sizeof(t->dbus), "%s", dbusParam);
+   snprintf(t->dest, sizeof(t->dest), "%s", destParam);
+   snprintf(t->layer, sizeof(t->layer), "%s", layerParam);
+   snprintf(t->win, sizeof(t->win), "%s", winParam);
+   snprintf(t->file, sizeof(t->file), "%s", sourceFile);
+   t->probe=probe;
+   snprintf(dbusParam, sizeof(dbusParam), "%s", tileSaved.dbus);
+   snprintf(destParam, sizeof(destParam), "%s", tileSaved.dest);
+   snprintf(layerParam, sizeof(layerParam), "%s", tileSaved.layer);
+   snprintf(winParam, sizeof(winParam), "%s", tileSaved.win);
+   snprintf(sourceFile, sizeof(sourceFile), "%s", tileSaved.file);
+   probe=tileSaved.probe;
+}
+
+static void tileStart(int i, double pos) {
+   XOMX_tile *t=&tiles[i];
+   int keep=audioOff;
+
+   snprintf(tileVideo, sizeof(tileVideo), "%s", videoFile);
+   tileSwap(t);
+   snprintf(videoFile, sizeof(videoFile), "%s", sourceFile);
+   audioOff=!t->audio;
+   buildPlayerArgs(pos);
+   audioOff=keep;
+   t->pid=spawn(playerArgs);
+   playerStarts++;
+   tilePos[i]=pos;
+   tileAnchor[i]=realUs();
+   tilePaused[i]=0;
+   tileSwap(t);
+   snprintf(videoFile, sizeof(videoFile), "%s", tileVideo);
+}
+
+/* Send v to tile i. Returns the pid of the command, 0 if the tile isn't playing */
+static pid_t tileSend(int i, const char **v) {
+   char dest[sizeof(destParam)];
+   pid_t p;
+
+   if (i==0)
+      return (omxplayer_pid > 0) ? spawn(v) : 0;
+   if (tiles[i].pid <= 0)
+      return 0;
+   memcpy(dest, destParam, sizeof(dest));
+   snprintf(destParam, sizeof(destParam), "%s", tiles[i].dest);
+   p=spawn(v);
+   memcpy(destParam, dest, sizeof(dest));
+   return p;
+}
+
+/* Send v to every tile (just omxplayer if this isn't a mosaic), all at once; with wait, return when they are done */
+static pid_t mosaicSend(const char **v, int wait) {
+   pid_t p[LENGTH(tiles)], r;
+   int i, status, n=(tileCount > 0) ? tileCount : 1;
+
+   for (i=0; i<n; i++)
+      p[i]=tileSend(i, v);
+   for (i=0; wait && i<n; i++) {
+      if (p[i] <= 0)
+         continue;
+      while ((r=waitpid(p[i], &status, 0))==-1 && errno==EINTR)
+         ;
+      cmdDone(p[i]);
+      if (r==p[i])
+         childExited(status);
+   }
+   return p[0];
+}
+
+/* Source crop for filling a w x h tile: the middle of the source, at the tile's aspect ratio */
+static void tileCrop(const XOMX_probe *info, unsigned int w, unsigned int h) {
+   double cw=info->width, ch=info->height;
+
+   if (w*ch > h*cw)   /* Tile is wider: crop top and bottom */
+      ch=cw*h/w;
+   else
+      cw=ch*w/h;
+   snprintf(cropParam, sizeof(cropParam), "string:%i %i %i %i", (int)(info->width-cw)/2, (int)(info->height-ch)/2,
+      (int)(info->width+cw)/2, (int)(info->height+ch)/2);
+}
+
+/* Lay the tiles out in the window rectangle x, y, w, h (omxplayer coordinates): a grid of near square cells. Each
+ * tile's rectangle goes in its win (tile 0's in winParam) and, with send, its VideoPos is sent. Returns tile 0's.
+ */
+static pid_t mosaicLayout(int x, int y, unsigned int w, unsigned int h, int send) {
+   int i, cols=1, rows, tx, ty;
+   unsigned int tw, th;
+   XOMX_probe *info;
+   pid_t p, p0=0;
+
+   while (cols*cols < tileCount)
+      cols++;
+   rows=(tileCount+cols-1)/cols;
+   for (i=0; i<tileCount; i++) {
+      tx=x+(i%cols)*w/cols;
+      ty=y+(i/cols)*h/rows;
+      tw=x+(i%cols+1)*w/cols-tx;
+      th=y+(i/cols+1)*h/rows-ty;
+      info=(i==0) ? &probe : &tiles[i].probe;
+      if (mosaicCrop && info->width > 0 && info->height > 0 && tw > 0 && th > 0) {
+         tileCrop(info, tw, th);
+         if (send)
+            tileSend(i, set_crop);
+      }
+#ifdef XOMX_SNAP
+      else if (i==0)
+         snapRect(&tx, &ty, &tw, &th);
+      else {
+         XOMX_probe keep=probe;
+
+         probe=*info;   /* snapRect() goes by probe */
+         snapRect(&tx, &ty, &tw, &th);
+         probe=keep;
+      }
+#endif
+      snprintf((i==0) ? winParam : tiles[i].win, sizeof(winParam), "%i %i %i %i", tx, ty, tx+tw, ty+th);
+      if (send) {
+         snprintf(resizeParam, sizeof(resizeParam), "string:%s", (i==0) ? winParam : tiles[i].win);
+         p=tileSend(i, resize_player);
+         if (i==0)
+            p0=p;
+      }
+   }
+   return p0;
+}
+
+/* Start the tiles after the first, once mosaicLayout() has placed them */
+static void mosaicStart(void) {
+   int i;
+
+   for (i=1; i<tileCount; i++)
+      tileStart(i, 0);   /* Without audio: tile 0 has the focus */
+}
+
+/* Quit the tiles after the first, as stopPlayer() does omxplayer */
+static void mosaicStop(void) {
+   int i, n, left, status;
+
+   mosaicSend(quit_player, 0);
+   for (n=0; n<30; n++) {   /* 3 seconds */
+      for (i=1, left=0; i<tileCount; i++) {
+         if (tiles[i].pid > 0 && waitpid(tiles[i].pid, &status, WNOHANG)==tiles[i].pid) {
+            childExited(status);
+            tiles[i].pid=0;
+         }
+         left+=(tiles[i].pid > 0);
+      }
+      if (left==0)
+         return;
+      usleep(100000);
+   }
+   for (i=1; i<tileCount; i++) {
+      if (tiles[i].pid > 0) {
+         fprintf(stderr, "ERROR: xomxplayer: tile %i not responding, sending SIGKILL.\n", i);
+         kill(tiles[i].pid, SIGKILL);
+         if (waitpid(tiles[i].pid, &status, 0)==tiles[i].pid)
+            childExited(status);
+         playerKills++;
+         tiles[i].pid=0;
+      }
+   }
+}
+
+/* Called for each child reaped */
+/* Tiles after the first which are still playing */
+static int mosaicLeft(void) {
+   int i, left=0;
+
+   for (i=1; i<tileCount; i++)
+      left+=(tiles[i].pid > 0);
+   return left;
+}
+
+/* Move the keyboard focus to the next tile which is playing */
+static void mosaicFocus(void) {
+   int i, n;
+
+   for (n=1; n<=tileCount; n++) {
+      i=(tileFocus+n)%tileCount;
+      if ((i==0) ? omxplayer_pid > 0 : tiles[i].pid > 0)
+         break;
+   }
+   if (n > tileCount)
+      return;
+   tileFocus=i;
+   if (dis!=NULL)
+      XStoreName(dis, win, (i==0) ? sourceFile : tiles[i].file);
+}
+
+/* A tile's player has ended: if it had the focus, pass it on (and with it the sound, see audioRun()) */
+static void mosaicReaped(pid_t chld_pid) {
+   int i;
+
+   for (i=1; i<tileCount; i++) {
+      if (chld_pid==tiles[i].pid) {
+         tiles[i].pid=0;
+         if (i==tileFocus)
+            mosaicFocus();
+      }
+   }
+}
+
+/* Command chain: dbus commands to every player which must be applied in order (hide, VideoPos, show for a move
+ * with hideOnMove). Each is spawned when the one before has been reaped, so the X loop never waits on dbus-send.
+ */
+static const char **chain[4];
+static int chainLen, chainPos;
+static pid_t chainPid;          /* Command being waited for */
+
+/* Spawn the next command unless one is running. Returns microseconds to poll for it in, -1 if the chain is empty */
+static long long chainRun(void) {
+   if (chainPid > 0)
+      return 20000;
+   while (chainPos < chainLen) {
+      if ((chainPid=mosaicSend(chain[chainPos++], 0)) > 0)
+         return 20000;
+   }
+   chainLen=chainPos=0;
+   return -1;
+}
+
+/* Queue v, after p (a command already sent, 0 if none) if nothing is queued */
+static void chainAdd(const char **v, pid_t p) {
+   if (chainPid <= 0 && chainPos==chainLen)
+      chainPid=p;
+   if (chainLen < (int)LENGTH(chain))
+      chain[chainLen++]=v;
+   chainRun();
+}
+
+/* Called for each child reaped */
+static void chainReaped(pid_t chld_pid) {
+   if (chainPid > 0 && chld_pid==chainPid) {
+      chainPid=0;
+      chainRun();
+   }
+}
+
+/* Macro runner. A step isn't started until the one before has exited, and cmdWait() allows its command, so the
+ * steps happen in order instead of racing; macroRun() is polled from the main loop until the macro is done.
+ * Steps go to the tile which had the focus when the macro started. A SetPosition is a seek: on tile 0 its target is
+ * prefetched first, as for the seek keys.
+ */
+static const XOMX_step *macro;    /* Next step, NULL if no macro is running */
+static pid_t macroPid;            /* Step being waited for */
+static long long macroStart;
+static unsigned long macroRuns;
+static long long macroUs;         /* Total time of the macros run */
+static int macroTile;             /* Mosaic tile the macro was started on, which its steps go to */
+
+/* Start the steps which can be started. Returns microseconds until it should be called again, -1 when idle */
+static long long macroRun(void) {
+   const char **v;
+   long wait;
+
+   while (macro!=NULL && (macro->v!=NULL || macro->op)) {
+      if (macroPid > 0)
+         return 5000;   /* Polled until reaped by the main loop (macroReaped()) */
+      v=(macro->op==macroSetPosition) ? set_position : macro->v;
+      if (v!=NULL && (wait=cmdWait(v)) > 0)
+         return wait;
+      if (macro->op==macroSetPosition && macroTile==0 && (wait=prefetchSeek(macro->arg)) > 0)
+         return wait;
+      switch (macro->op) {
+      case macroFullScreen:   /* Full screen whatever the state was */
+         if (dis!=NULL)
+            setFS(1);
+         break;
+      case macroSetPosition:
+         snprintf(setPosParam, sizeof(setPosParam), "int64:%lld", (long long)(macro->arg*1e6));
+         if (macroTile > 0) {
+            tilePos[macroTile]=macro->arg;
+            tileAnchor[macroTile]=realUs();
+         }
+         else {
+            playPos=macro->arg;
+            playAnchor=realUs();
+         }
+         break;
+      }
+      if (v==play_player && macroTile > 0 && tilePaused[macroTile])
+         tileMark(macroTile, 0, 1);
+      else if (v==play_player && macroTile==0 && playPaused)
+         playMark(0, 1);
+      if (v!=NULL && (macroPid=tileSend(macroTile, v)) < 0)
+         macroPid=0;
+      macro++;
+   }
+   if (macro==NULL)
+      return -1;
+   if (macroPid > 0)
+      return 5000;   /* The last step */
+   macroRuns++;
+   macroUs+=nowUs()-macroStart;
+#ifdef DEBUG
+   fprintf(stderr, "Macro done in %lli ms.\n", (nowUs()-macroStart)/1000);
+#endif
+   macro=NULL;
+   return -1;
+}
+
+/* Child chld_pid has exited */
+static void macroReaped(pid_t chld_pid) {
+   if (macroPid > 0 && chld_pid==macroPid) {
+      macroPid=0;
+      macroRun();
+   }
+}
+
+/* Adapted from dwm keypress() (http://suckless.org/)
+ * Returns updated omxplayerRunning
+ */
+/* Keys whose command omxplayer can't take yet (cmdWait()), sent in order by keysRun() */
+static int keyQueue[8];
+static int keyQueued;
+
+static void keySend(int i) {
+   spawn(keys[i].v);
+   if (keys[i].seek || keys[i].v==pause_player)
+      playMark(keys[i].seek, keys[i].v==pause_player);
+}
+
+/* Send the queued keys omxplayer can take now, a seek once its target has been prefetched.
+ * Returns microseconds until the next may be sent, -1 if none are queued.
+ */
+static long long keysRun(void) {
+   long long wait;
+
+   while (keyQueued > 0) {
+      if ((wait=cmdWait(keys[keyQueue[0]].v)) > 0)
+         return wait;
+      if (keys[keyQueue[0]].seek && (wait=prefetchSeek(playPosition()+keys[keyQueue[0]].seek)) > 0)
+         return wait;
+      keySend(keyQueue[0]);
+      memmove(keyQueue, keyQueue+1, --keyQueued*sizeof(keyQueue[0]));
+   }
+   return -1;
+}
+
+static int keypress(XEvent *e) {
+   unsigned int i;
+   KeySym keysym;
+   XKeyEvent *ev;
+
+   ev = &e->xkey;
+   keysym = XKeycodeToKeysym(dis, (KeyCode)ev->keycode, 0);
+   if (keysym==quitKey) {
+      spawn(quit_player);
+      return 0; /* Quit player */
+   }
+   if (keysym==fullScreenKey) {
+      toggleFS();
+      return 1; /* Don't quit player */
+   }
+   if (keysym==tileFocusKey && tileCount > 0) {
+      mosaicFocus();
+      return 1;
+   }
+   for (i = 0; i < LENGTH(keys); i++) {
+      if (keysym==keys[i].keysym && keys[i].macro!=NULL) {
+         if (macro==NULL) {
+            macro=keys[i].macro;
+            macroTile=tileFocus;
+            macroStart=nowUs();
+            macroRun();
+         }
+      #ifdef DEBUG
+         else
+            fprintf(stderr, "Macro running, key dropped.\n");
+      #endif
+         break;
+      }
+      if (keysym==keys[i].keysym) {
+         if (tileFocus > 0) {   /* Another tile of the mosaic: the seek target is tile 0's */
+            tileSend(tileFocus, keys[i].v);
+            if (keys[i].seek || keys[i].v==pause_player)
+               tileMark(tileFocus, keys[i].seek, keys[i].v==pause_player);
+         }
+         else if (keys[i].seek && keyQueued > 0 && keyQueue[keyQueued-1]==(int)i) {
+         #ifdef DEBUG   /* Auto repeat of a seek: one is enough while omxplayer is busy */
+            fprintf(stderr, "omxplayer busy, repeated seek dropped.\n");
+         #endif
+         }
+         else if (keyQueued < (int)LENGTH(keyQueue)) {
+            keyQueue[keyQueued++]=i;   /* e.g. a quick second pause: sent when omxplayer can take it */
+            keysRun();
+         }
+         break;
+      }
+   }
+   return 1;   /* Don't quit player */
+}
+
+/* Losing the X server: Xlib calls xioError(), which would otherwise exit, and it jumps back to the main loop. The
+ * connection is dropped (xDetach()) and omxplayer goes on playing, under dbus control, with the playlist advancing.
+ * xReattach() is tried with backoff until a display is back, and win is made again at the last geometry.
+ * Until the main loop has set xLost (xLostSet) there is nowhere to jump to, and the connection lost exits as before.
+ */
+static jmp_buf xLost;
+static volatile int xLostSet;
+static long long xLostAt, xRetryAt;
+static int xRetryMs;
+
+static int xioError(Display *d) {
+   if (!xLostSet) {
+      fprintf(stderr, "X server connection lost while starting.\n");
+      exit(1);
+   }
+   longjmp(xLost, 1);
+   return 0;
+}
+
+/* Forget the dead connection without talking to the server */
+static void xDetach(void) {
+   if (poster!=NULL) {
+      if (posterShm.shmaddr) {
+         poster->data=NULL;
+         shmdt(posterShm.shmaddr);
+         posterShm.shmaddr=NULL;
+      }
+      XDestroyImage(poster);   /* Local only */
+      poster=NULL;
+   }
+   posterGC=NULL;
+   posterShown=0;
+   if (dis!=NULL)
+      close(ConnectionNumber(dis));
+   dis=NULL;   /* The Display itself is leaked; Xlib can't free it without the server */
+   if (geom.frame!=None) {   /* Make win again where its frame was */
+      geom.x=geom.frameX-geom.frameBw;
+      geom.y=geom.frameY-geom.frameBw;
+      geom.frame=None;
+   }
+   geomGiven=1;
+   xLostAt=nowUs();
+   xRetryMs=xRetryMinMs;
+   xRetryAt=xLostAt+xRetryMs*1000LL;
+   fprintf(stderr, "X server connection lost; omxplayer carries on.\n");
+}
+
+/* dbus name and layer of this instance's omxplayer */
+static void initNames(void) {
+   snprintf(pid,15,"%i",getpid());
+   if (layerParam[0]=='\0')
+      snprintf(layerParam, sizeof(layerParam), "%s", pid);
+   strncpy(dbusParam, "org.mpris.MediaPlayer2.omxplayer", 96);
+   strncat(dbusParam, pid, 8);
+   strncpy(destParam, "--dest=", 8);
+   strncat(destParam, dbusParam, 128);
+}
+
+static int initX(float sx, float sy) {
+   XSetWindowAttributes attr;
+   long bypass=1;    /* _NET_WM_BYPASS_COMPOSITOR: 1 = please unredirect */
+
+   if ((dis=XOpenDisplay(NULL))==NULL)
+      return -1;
+   XSetIOErrorHandler(xioError);
+   attr.background_pixmap=None;  /* Never painted by the server; covered by the overlay */
+   attr.border_pixel=BlackPixel(dis, 0);
+   attr.backing_store=NotUseful;
+   attr.save_under=False;
+   attr.override_redirect=overrideRedirect;
+   if (!geomGiven) {
+      geom.x=geom.y=1;
+      geom.w=(int)(1024*sx);
+      geom.h=(int)(576*sy);
+   }
+   win=XCreateWindow(dis, DefaultRootWindow(dis), geom.x, geom.y, geom.w, geom.h, 0, CopyFromParent, InputOutput, CopyFromParent,
+      CWBackPixmap | CWBorderPixel | CWBackingStore | CWSaveUnder | CWOverrideRedirect, &attr);
+   XSetStandardProperties(dis, win, sourceFile, sourceFile, None, NULL, 0, NULL);
+   netOpaqueRegion=XInternAtom(dis, "_NET_WM_OPAQUE_REGION", False);
+   setOpaqueRegion(geom.w, geom.h);
+   XChangeProperty(dis, win, XInternAtom(dis, "_NET_WM_BYPASS_COMPOSITOR", False), XA_CARDINAL, 32, PropModeReplace,
+      (unsigned char *)&bypass, 1);
+   XSelectInput(dis, win, KeyPressMask | StructureNotifyMask | VisibilityChangeMask | PropertyChangeMask);
+   netFrameExtents=XInternAtom(dis, "_NET_FRAME_EXTENTS", False);
+   xhints(sx, sy);
+   wmDeleteMessage = XInternAtom(dis, "WM_DELETE_WINDOW", False);
+   XSetWMProtocols(dis, win, &wmDeleteMessage, 1); 
+   XMapWindow(dis, win);
+   if (overrideRedirect)
+      XSetInputFocus(dis, win, RevertToParent, CurrentTime);
+   XFlush(dis);
+
+   return ConnectionNumber(dis);
+}
+
+/* Replace w, the previous controller's window (live upgrade), with a new win at geom. w isn't kept: a window manager
+ * sends WM_DELETE_WINDOW with no event mask, which only reaches the client that made the window, so an adopted window
+ * couldn't be closed. The new one is mapped before the old is destroyed, and main() moves the overlay to it.
+ * Returns the X fd, -1 if there is no display.
+ */
+static int adoptX(float sx, float sy, Window w) {
+   XErrorHandler old;
+   int fd;
+
+   if (geom.frame!=None) {   /* Where the window manager had the frame */
+      geom.x=geom.frameX-geom.frameBw;
+      geom.y=geom.frameY-geom.frameBw;
+      geom.frame=None;
+   }
+   geomGiven=1;
+   if ((fd=initX(sx, sy))==-1 || w==None)
+      return fd;
+   old=XSetErrorHandler(xError);   /* Gone already if the X server was restarted */
+   XDestroyWindow(dis, w);
+   XSync(dis, False);
+   XSetErrorHandler(old);
+   return fd;
+}
+
+/* Returns the X fd once connected again, -1 to try again at xRetryAt */
+static int xReattach(float sx, float sy) {
+   int fd;
+
+   if ((fd=initX(sx, sy))==-1) {
+      xRetryMs=(xRetryMs*2 > xRetryMaxMs) ? xRetryMaxMs : xRetryMs*2;
+      xRetryAt=nowUs()+xRetryMs*1000LL;
+      return -1;
+   }
+   if (omxplayer_pid > 0) {   /* Re-sync the overlay with the new window */
+      snprintf(resizeParam, sizeof(resizeParam), "string:%s", winParam);
+      spawn(resize_player);
+   }
+   fprintf(stderr, "X server back after %lli ms.\n", (nowUs()-xLostAt)/1000);
+   return fd;
+}
+
+#ifdef XOMX_FB_DEV
+static int setScale(float *sx, float *sy) {
+   int fb_fd = 0;
+   struct fb_var_screeninfo fb_info;
+
+   fb_fd = open(XOMX_FB_DEV, O_RDONLY);
+   if (fb_fd == -1) {
+      fprintf(stderr, "setScale: Error opening %s; not setting scale factor.\n", XOMX_FB_DEV);
+      return 1;
+   }
+   if (ioctl(fb_fd, FBIOGET_VSCREENINFO, &fb_info)) {
+      printf("setScale: Error reading screen info; not setting scale factor.\n");
+      close(fb_fd);
+      return 1;
+   }
+   *sx=(float)(fb_info.xres)/1920;
+   *sy=(float)(fb_info.yres)/1080;
+   close(fb_fd);
+   return 0;
+}
+#endif
+
+/* Visibility hysteresis: the video is hidden / shown only when the window has stayed obscured / unobscured for
+ * visHideMs / visShowMs. The latest VisibilityNotify wins, so a transient change costs no commands.
+ */
+static int videoHidden;          /* Video hidden because the window is obscured */
+static int visPending=-1;        /* Wanted videoHidden, -1 if nothing is pending */
+static long long visDeadline;
+static unsigned long visEvents;  /* Commands the window changes would have sent without the hysteresis */
+static unsigned long visCmds;    /* Commands sent */
+static long long visSince;
+static long long visTime[2];     /* Time spent shown / hidden, up to visChanged */
+static long long visChanged;
+
+/* Add the time since the last change to visTime[videoHidden] */
+static void visibilityAccount(void) {
+   long long t=nowUs();
+
+   visTime[videoHidden]+=t-(visChanged ? visChanged : visSince);
+   visChanged=t;
+}
+
+static void visibilityChanged(int obscured) {
+   visEvents++;
+   if (obscured==videoHidden) {
+      visPending=-1;   /* Back as it was; nothing to send */
+      return;
+   }
+   visPending=obscured;
+   visDeadline=nowUs()+(obscured ? visHideMs : visShowMs)*1000LL;
+}
+
+/* Apply a pending change if it is due. While moveHidden the video is already hidden, and is shown (or not)
+ * when the move ends. Returns microseconds until the pending change is due, or -1 if none.
+ */
+static long long visibilityRun(int moveHidden) {
+   long long t=nowUs();
+
+   if (visPending==-1)
+      return -1;
+   if (t < visDeadline)
+      return visDeadline-t;
+   visibilityAccount();
+   videoHidden=visPending;
+   visPending=-1;
+   playHides+=videoHidden;
+   if (!moveHidden && omxplayer_pid > 0) {
+      mosaicSend(videoHidden ? hide_video : unhide_video, 0);
+      visCmds++;
+   }
+   return -1;
+}
+
+/* Session snapshot: what is needed to put the session back after a crash or power cut (xomxplayer --restore).
+ * It is kept mapped in ~/.cache/xomxplayer/session as two slots which are written in turn: the new state goes into
+ * the older slot, so a crash part way through leaves the other whole. A slot is valid if its checksum matches, and the
+ * valid one with the higher seq is used. sessionSave() is called from the main loop and only writes when something
+ * changed, which while playing includes the position every sessionPosS; the write back is left to the kernel
+ * (MS_ASYNC) so the loop never waits for the disk.
+ * A wall slot uses session-slot<n>. Other instances take the first of session, session.1, ... which no running
+ * instance holds (flock), so windows don't overwrite each other's snapshot and --restore puts them back in turn.
+ * A mosaic's other tiles are kept too; their files take the end of what was the playlist area, so the size (and with it
+ * the handover's layout) is unchanged.
+ */
+typedef struct {
+   unsigned int magic;
+   unsigned int seq;
+   unsigned int sum;       /* FNV-1a of seq and everything after sum */
+   int item, items;        /* Playlist cursor and length */
+   int x, y, w, h;         /* Root position and size of win */
+   int frameX, frameY;     /* Root position to create win at: its frame's, if it has one */
+   int hidden;             /* videoHidden */
+   int paused;
+   double pos;             /* Playback position at anchor, seconds */
+   long long anchor;       /* CLOCK_REALTIME, microseconds */
+   char layer[16];
+   char files[12288];      /* Playlist, absolute paths separated by '\0' */
+   int tiles;              /* Mosaic tiles after tile 0, 0 if not a mosaic */
+   char tileFiles[4092];   /* Their files, as files */
+} XOMX_session;
+
+static const unsigned int sessionMagic=0x584f4d32;
+static XOMX_session *session;   /* The two slots, NULL if there is no session file */
+static XOMX_session sessionNow;
+static char *sessionList[1024]; /* Restored playlist, in sessionFiles */
+static char sessionFiles[12288];
+static char *sessionTileList[LENGTH(tiles)];
+static char sessionTileFiles[4092];
+static unsigned long sessionWrites;
+
+static unsigned int sessionSum(const XOMX_session *s) {
+   const unsigned char *p=(const unsigned char *)&s->item;
+   size_t i, n=sizeof(*s)-offsetof(XOMX_session, item);
+   unsigned int h=2166136261u^s->seq;
+
+   for (i=0; i<n; i++)
+      h=(h^p[i])*16777619u;
+   return h;
+}
+
+/* Newest valid slot, -1 if there is none */
+static int sessionLatest(void) {
+   int i, best=-1;
+
+   for (i=0; session!=NULL && i<2; i++) {
+      if (session[i].magic==sessionMagic && session[i].sum==sessionSum(&session[i]) &&
+            (best==-1 || (int)(session[i].seq-session[best].seq) > 0))
+         best=i;
+   }
+   return best;
+}
+
+/* slot: wall slot, -1 if none */
+static void sessionOpen(int slot) {
+   char path[4200], name[32];
+   int fd=-1, i;
+
+   for (i=0; i<16 && fd==-1; i++) {
+      if (slot >= 0)
+         snprintf(name, sizeof(name), "session-slot%i", slot);
+      else if (i==0)
+         snprintf(name, sizeof(name), "session");
+      else
+         snprintf(name, sizeof(name), "session.%i", i);
+      if (cachePath(path, sizeof(path), name) || (fd=open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644))==-1)
+         return;
+      if (flock(fd, LOCK_EX | LOCK_NB)) {   /* Another instance's, kept open (and locked) until it exits */
+         close(fd);
+         fd=-1;
+         if (slot >= 0)
+            break;
+      }
+   }
+   if (fd==-1) {
+      fprintf(stderr, "No free session file, the session won't be saved.\n");
+      return;
+   }
+   if (ftruncate(fd, 2*sizeof(XOMX_session))==0) {
+      session=mmap(NULL, 2*sizeof(XOMX_session), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (session==MAP_FAILED)
+         session=NULL;
+   }
+   if (session==NULL)
+      close(fd);
+#ifdef DEBUG
+   else
+      fprintf(stderr, "Session file %s.\n", name);
+#endif
+}
+
+/* Add file to buf as an absolute path. Returns 1 if it doesn't fit */
+static int sessionAdd(char *buf, size_t len, size_t *used, const char *file) {
+   char path[PATH_MAX];
+   size_t n;
+
+   if (realpath(file, path)==NULL)
+      snprintf(path, sizeof(path), "%s", file);
+   n=strlen(path)+1;
+   if (*used+n >= len)
+      return 1;
+   memcpy(buf+*used, path, n);
+   *used+=n;
+   return 0;
+}
+
+/* Keep the playlist, and a mosaic's other tiles, in sessionNow as absolute paths */
+static void sessionPlaylist(void) {
+   size_t used=0;
+   int i;
+
+   for (i=0; i<playlistLen && !sessionAdd(sessionNow.files, sizeof(sessionNow.files), &used, playlist[i]); i++)
+      ;   /* What doesn't fit isn't restored */
+   sessionNow.items=i;
+   for (i=1, used=0; i<tileCount && !sessionAdd(sessionNow.tileFiles, sizeof(sessionNow.tileFiles), &used, tiles[i].file); i++)
+      ;
+   sessionNow.tiles=(tileCount > 0) ? i-1 : 0;
+}
+
+static void sessionFill(void) {
+   sessionNow.item=playlistCur;
+   sessionNow.x=geom.x;
+   sessionNow.y=geom.y;
+   sessionNow.w=geom.w;
+   sessionNow.h=geom.h;
+   sessionNow.frameX=(geom.frame!=None) ? geom.frameX-geom.frameBw : geom.x;
+   sessionNow.frameY=(geom.frame!=None) ? geom.frameY-geom.frameBw : geom.y;
+   sessionNow.hidden=videoHidden;
+   sessionNow.paused=playPaused;
+   sessionNow.pos=playPos;
+   sessionNow.anchor=playAnchor;
+   if (!playPaused && playAnchor > 0 && sessionPosS > 0) {   /* Where it was at the last whole sessionPosS, and when */
+      sessionNow.pos+=(long long)((realUs()-playAnchor)/1e6/sessionPosS)*sessionPosS;
+      sessionNow.anchor=playAnchor+(long long)((sessionNow.pos-playPos)*1e6);
+   }
+   snprintf(sessionNow.layer, sizeof(sessionNow.layer), "%s", layerParam);
+}
+
+/* Write the state into the older slot if it differs from the newest */
+static void sessionSave(void) {
+   XOMX_session *slot;
+   int last;
+   size_t n=sizeof(XOMX_session)-offsetof(XOMX_session, item);
+
+   if (session==NULL || playAnchor==0)
+      return;   /* Nothing has been played yet */
+   sessionFill();
+   last=sessionLatest();
+   if (last!=-1 && !memcmp(&session[last].item, &sessionNow.item, n))
+      return;
+   slot=&session[(last==0) ? 1 : 0];
+   memcpy(&slot->item, &sessionNow.item, n);
+   slot->seq=(last==-1) ? 1 : session[last].seq+1;
+   slot->magic=sessionMagic;
+   slot->sum=sessionSum(slot);
+   msync(session, 2*sizeof(XOMX_session), MS_ASYNC);
+   sessionWrites++;
+}
+
+/* Make the playlist of s the playlist. Returns 0 on success */
+static int sessionLoad(const XOMX_session *s) {
+   char *f;
+   int i;
+
+   memcpy(sessionFiles, s->files, sizeof(sessionFiles));
+   sessionFiles[sizeof(sessionFiles)-1]='\0';
+   for (i=0, f=sessionFiles; i<s->items && i<(int)LENGTH(sessionList) && *f; i++, f+=strlen(f)+1)
+      sessionList[i]=f;
+   if (s->item < 0 || s->item >= i)
+      return 1;
+   playlist=sessionList;
+   playlistLen=i;
+   return 0;
+}
+
+/* The newest snapshot, with its playlist made the playlist and its mosaic rebuilt; NULL if there is nothing to restore */
+static const XOMX_session *sessionRestore(void) {
+   int last=sessionLatest(), i;
+   char *f;
+
+   if (last==-1 || sessionLoad(&session[last]))
+      return NULL;
+   if (session[last].tiles > 0) {
+      memcpy(sessionTileFiles, session[last].tileFiles, sizeof(sessionTileFiles));
+      sessionTileFiles[sizeof(sessionTileFiles)-1]='\0';
+      for (i=0, f=sessionTileFiles; i<session[last].tiles && i<(int)LENGTH(sessionTileList) && *f; i++, f+=strlen(f)+1)
+         sessionTileList[i]=f;
+      mosaicInit(sessionTileList, i);
+   }
+   return &session[last];
+}
+
+/* Schedule (--schedule <file>): lines of
+ *    HH:MM[:SS] file...                    play these files, looping, from this time each day
+ *    HH:MM[:SS]-HH:MM[:SS] every file...   break into the loop with these files every interval (e.g. 15m, 90s, 1h)
+ *                                          within that time of day, then go back to it
+ * Local time; '#' starts a comment. The next firing of every entry is kept in a three level timer wheel (1s, 256s and
+ * 65536s slots), advanced by a timerfd ticking on the second. If the clock is set (TFD_TIMER_CANCEL_ON_SET) or the UTC
+ * offset changes (DST), the wheel is rebuilt from the new time. A switch stops omxplayer and starts the new list in
+ * the same window, as the playlist does.
+ */
+typedef struct XOMX_sched {
+   int at, until;    /* Seconds from midnight; until is only used with every */
+   int every;        /* Interval in seconds, 0 for a loop */
+   char **files;
+   int nfiles;
+   time_t due;       /* Next firing */
+   struct XOMX_sched *next;
+} XOMX_sched;
+
+static XOMX_sched *scheds;
+static int schedCount;
+static XOMX_sched *wheel[3][256];
+static time_t wheelNow;            /* The wheel has run up to here */
+static long schedOffset;           /* UTC offset the wheel was built with */
+static XOMX_sched *schedBase;      /* Loop due now */
+static XOMX_sched *schedCur;       /* Entry playing, NULL for the command line files */
+static long long schedDue;         /* Time the last switch was due, microseconds; 0 once it has been measured */
+static unsigned long schedTicks, schedSwitches;
+static long long schedUs, schedLateUs;
+
+/* Seconds from midnight for HH:MM[:SS]; -1 if it isn't one */
+static int schedTime(const char *p, const char **end) {
+   int h, m, sec=0, n=0;
+
+   if (sscanf(p, "%d:%d%n:%d%n", &h, &m, &n, &sec, &n) < 2 || h<0 || h>23 || m<0 || m>59 || sec<0 || sec>59)
+      return -1;
+   *end=p+n;
+   return h*3600+m*60+sec;
+}
+
+/* First firing of e after t */
+static time_t schedNext(const XOMX_sched *e, time_t t) {
+   struct tm tm;
+   time_t start, end;
+   int day;
+
+   for (day=-1; day<=1; day++) {   /* An interval window may have opened yesterday */
+      localtime_r(&t, &tm);
+      tm.tm_mday+=day;
+      tm.tm_hour=e->at/3600;
+      tm.tm_min=e->at/60%60;
+      tm.tm_sec=e->at%60;
+      tm.tm_isdst=-1;
+      start=mktime(&tm);
+      if (e->every==0) {
+         if (start > t)
+            return start;
+         continue;
+      }
+      end=start+((e->until > e->at) ? e->until-e->at : e->until+86400-e->at);
+      if (start <= t)
+         start+=((t-start)/e->every+1)*e->every;
+      if (start < end)
+         return start;
+   }
+   return t+86400;
+}
+
+static int schedLoad(const char *file) {
+   struct stat st;
+   char *buf=NULL, *line, *tok, *save, *save2, **files;
+   const char *p;
+   XOMX_sched *e;
+   int fd, n, unit;
+   ssize_t r=0;
+   off_t len=0;
+
+   if ((fd=open(file, O_RDONLY))!=-1 && fstat(fd, &st)==0 && (buf=malloc(st.st_size+1))!=NULL) {
+      while (len < st.st_size && ((r=read(fd, buf+len, st.st_size-len)) > 0 || (r==-1 && errno==EINTR)))
+         len+=(r > 0) ? r : 0;
+   }
+   if (fd!=-1)
+      close(fd);
+   if (buf==NULL || r==-1) {
+      fprintf(stderr, "Schedule: can't read %s.\n", file);
+      free(buf);
+      return 1;
+   }
+   buf[len]='\0';   /* Kept: the file names point into it */
+   for (line=strtok_r(buf, "\n", &save); line!=NULL; line=strtok_r(NULL, "\n", &save)) {
+      if ((tok=strchr(line, '#'))!=NULL)
+         *tok='\0';
+      if ((tok=strtok_r(line, " \t", &save2))==NULL)
+         continue;
+      if ((e=realloc(scheds, (schedCount+1)*sizeof(XOMX_sched)))==NULL) {
+         fprintf(stderr, "Schedule: out of memory.\n");
+         return 1;   /* The entries so far are kept */
+      }
+      scheds=e;
+      e=&scheds[schedCount];
+      memset(e, 0, sizeof(*e));
+      if ((e->at=schedTime(tok, &p)) < 0 || (*p=='-' && (e->until=schedTime(p+1, &p)) < 0) || *p!='\0') {
+         fprintf(stderr, "Schedule: bad time %s.\n", tok);
+         continue;
+      }
+      if (strchr(tok, '-')) {
+         if ((tok=strtok_r(NULL, " \t", &save2))==NULL || sscanf(tok, "%d%n", &e->every, &n)!=1 || e->every <= 0) {
+            fprintf(stderr, "Schedule: bad interval at %s.\n", line);
+            continue;
+         }
+         unit=tok[n];
+         e->every*=(unit=='h') ? 3600 : (unit=='m') ? 60 : 1;
+      }
+      while ((tok=strtok_r(NULL, " \t", &save2))!=NULL) {
+         if ((files=realloc(e->files, (e->nfiles+1)*sizeof(char *)))==NULL)
+            break;
+         e->files=files;
+         e->files[e->nfiles++]=tok;
+      }
+      if (e->nfiles > 0)
+         schedCount++;
+   }
+   return 0;
+}
+
+static void wheelAdd(XOMX_sched *e) {
+   long long d=e->due-wheelNow;
+   int lvl, slot;
+
+   if (d < 1) {   /* Overdue: next tick */
+      lvl=0;
+      slot=(wheelNow+1)&255;
+   }
+   else if (d < 256) {
+      lvl=0;
+      slot=e->due&255;
+   }
+   else if (d < 65536) {
+      lvl=1;
+      slot=(e->due>>8)&255;
+   }
+   else {
+      lvl=2;
+      slot=(e->due>>16)&255;
+   }
+   e->next=wheel[lvl][slot];
+   wheel[lvl][slot]=e;
+}
+
+/* Put the entries due in a slot of a higher level into the lower ones */
+static void wheelCascade(int lvl, int slot) {
+   XOMX_sched *e=wheel[lvl][slot], *next;
+
+   wheel[lvl][slot]=NULL;
+   for (; e!=NULL; e=next) {
+      next=e->next;
+      wheelAdd(e);
+   }
+}
+
+/* (Re)build the wheel for time t. Returns the loop which should be playing now, NULL if none */
+static XOMX_sched *schedAnchor(time_t t) {
+   XOMX_sched *base=NULL;
+   time_t last=0, prev;
+   struct tm tm;
+   int i;
+
+   memset(wheel, 0, sizeof(wheel));
+   wheelNow=t;
+   localtime_r(&t, &tm);
+   schedOffset=tm.tm_gmtoff;
+   for (i=0; i<schedCount; i++) {
+      scheds[i].due=schedNext(&scheds[i], t);
+      wheelAdd(&scheds[i]);
+      if (scheds[i].every==0 && (prev=scheds[i].due-86400) <= t && (base==NULL || prev > last)) {
+         base=&scheds[i];   /* Most recent loop start: its last firing was a day before the next */
+         last=prev;
+      }
+   }
+   return base;
+}
+
+/* Run the wheel up to t; jumped if the clock has been set. Returns the entry to switch to, NULL for none */
+static XOMX_sched *schedRun(time_t t, int jumped) {
+   XOMX_sched *e, *next, *fire=NULL;
+   struct tm tm;
+   long long start=nowUs();
+
+   localtime_r(&t, &tm);
+   if (jumped || tm.tm_gmtoff!=schedOffset || t < wheelNow || t-wheelNow > 3600) {   /* Clock set, or DST */
+      e=schedAnchor(t);
+      schedUs+=nowUs()-start;
+      if (e!=schedBase) {
+         schedBase=e;
+         return (schedCur==NULL || schedCur->every==0) ? e : NULL;
+      }
+      return NULL;
+   }
+   while (wheelNow < t) {
+      wheelNow++;
+      if ((wheelNow&0xffff)==0)
+         wheelCascade(2, (wheelNow>>16)&255);
+      if ((wheelNow&255)==0)
+         wheelCascade(1, (wheelNow>>8)&255);
+      e=wheel[0][wheelNow&255];
+      wheel[0][wheelNow&255]=NULL;
+      for (; e!=NULL; e=next) {
+         next=e->next;
+         if (e->due <= wheelNow) {
+            if (e->every==0)
+               schedBase=e;
+            if (fire==NULL || e->every > 0)   /* A break takes precedence over a loop starting */
+               fire=e;
+            schedDue=e->due*1000000LL;
+            e->due=schedNext(e, wheelNow);
+         }
+         wheelAdd(e);
+      }
+   }
+   schedTicks++;
+   schedUs+=nowUs()-start;
+   return fire;
+}
+
+/* timerfd ticking on each second of the realtime clock, cancelled if the clock is set. Returns the fd or -1 */
+static int schedTimer(void) {
+   static int fd=-1;
+   struct itimerspec its={ { 1, 0 }, { 0, 0 } };
+   struct timespec now;
+
+   if (fd==-1 && (fd=timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC))==-1)
+      return -1;
+   clock_gettime(CLOCK_REALTIME, &now);
+   its.it_value.tv_sec=now.tv_sec+1;
+   if (timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL)) {
+      close(fd);
+      fd=-1;
+   }
+   return fd;
+}
+
+/* Play list from the start (NULL: the current list again). omxplayer is only started if start is set; a playing
+ * one is only told to quit, and the new one started when it has gone (playerReplace()).
+ */
+static void playlistSwitch(char **list, int len, int start) {
+   playerQuit(1);
+   if (list!=NULL) {
+      stageSetPlaylist(list, len);
+      sessionPlaylist();
+   }
+   loadItem(0);
+   if (!start)
+      return;
+   playerReplace(0);   /* Before anything goes to X, which may be lost (xioError() jumps back to the loop) */
+   if (dis!=NULL) {
+      XStoreName(dis, win, sourceFile);
+      showPoster();
+   }
+}
+
+/* Play e's files (NULL: the current list again from the start). omxplayer is only started if start is set */
+static void schedSwitch(XOMX_sched *e, int start) {
+   if (e!=NULL) {
+      schedCur=e;
+      schedSwitches++;
+   }
+   playlistSwitch(e!=NULL ? e->files : NULL, e!=NULL ? e->nfiles : 0, start);
+}
+
+/* Wall layouts: one xomxplayer per slot (--slot <n>), switched together to one of layouts[] by "xomxplayer --layout <n>"
+ * or layoutKey (the next one). The processes share /dev/shm/xomxplayer-wall-<uid>, where each registers its pid in its
+ * slot, with the pid's start time so a pid reused by another process after a crash isn't signalled.
+ * A switch bumps seq and signals them all (SIGUSR1). Each hides its video, moves its window and sends VideoPos straight
+ * away: the target is known, so there is no 500ms wait for the window to settle. When VideoPos returns the slot is
+ * marked as done, and the video is shown once every slot in the layout is done (polled), or layoutRevealMs after the
+ * switch started if one is slow, so the overlays appear together at their new places. A slot whose preset names another
+ * file hides its video and has its player replaced (playlistSwitch(), which doesn't wait for the old one); it is done
+ * once the new player has been started at the new place.
+ */
+typedef struct {
+   unsigned int seq;          /* Switch number, never 0 */
+   int preset;                /* Layout switched to */
+   long long deadline;        /* nowUs() by which the videos are shown whether or not all slots are done */
+   pid_t pid[LENGTH(layouts[0])];            /* xomxplayer in each slot, 0 if none */
+   unsigned int done[LENGTH(layouts[0])];    /* seq each slot has last moved for */
+   unsigned long long start[LENGTH(layouts[0])];   /* Start time of pid (pidStart()) */
+} XOMX_wall;
+
+static XOMX_wall *wall;        /* NULL if not part of a wall */
+static int layoutSlot=-1;
+static volatile sig_atomic_t layoutWanted;
+static unsigned int layoutSeq; /* Switch being applied, 0 if none */
+static pid_t layoutPid;        /* Its VideoPos */
+static int layoutHidden;       /* Video hidden for the switch */
+static XOMX_geom layoutGeom;   /* Where the switch put win, to tell its ConfigureNotify from a move; w 0 if none */
+static long long layoutBegan;
+static unsigned long layoutSwitches;
+static long long layoutUs;     /* Total time from the signal to showing the video */
+static char *layoutList[1];    /* Playlist for a slot's file */
+static int layoutReplacing;    /* The slot's player is being replaced for its file */
+
+static void layoutSignal(int sig) {
+   layoutWanted=1;
+}
+
+/* Start time of process p in clock ticks since boot (/proc/<p>/stat field 22), 0 if it doesn't exist */
+static unsigned long long pidStart(pid_t p) {
+   char path[64], buf[1024], *c;
+   unsigned long long start;
+
+   snprintf(path, sizeof(path), "/proc/%i/stat", p);
+   if (readSmall(path, buf, sizeof(buf)) <= 0 || (c=strrchr(buf, ')'))==NULL ||  /* Skip pid and (comm) */
+         sscanf(c+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &start)!=1)
+      return 0;
+   return start;
+}
+
+/* Is the process registered in slot i still the one which registered? */
+static int wallAlive(const XOMX_wall *w, unsigned int i) {
+   return w->pid[i] > 0 && pidStart(w->pid[i])==w->start[i];
+}
+
+/* Layout the wall is in, 0 if the shared preset isn't a valid one */
+static int wallPreset(const XOMX_wall *w) {
+   int preset=w->preset;
+
+   return (preset >= 0 && preset < (int)LENGTH(layouts)) ? preset : 0;
+}
+
+static void wallPath(char *path, size_t len) {
+   snprintf(path, len, "/dev/shm/xomxplayer-wall-%u", (unsigned int)getuid());
+}
+
+/* Map the wall, which only this user may open */
+static XOMX_wall *wallOpen(void) {
+   char path[64];
+   XOMX_wall *w;
+   struct stat st;
+   int fd;
+
+   wallPath(path, sizeof(path));
+   if ((fd=open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600))==-1)
+      return NULL;
+   if (fstat(fd, &st)==-1) {
+      close(fd);
+      return NULL;
+   }
+   if (st.st_uid!=getuid() || (st.st_mode & 077)) {
+      close(fd);
+      errno=EPERM;   /* Someone else's */
+      return NULL;
+   }
+   if (st.st_size < (off_t)sizeof(*w) && ftruncate(fd, sizeof(*w))==-1) {
+      close(fd);
+      return NULL;
+   }
+   w=mmap(NULL, sizeof(*w), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   return (w==MAP_FAILED) ? NULL : w;
+}
+
+/* Start switching the wall to layouts[preset]. Returns the number of slots signalled */
+static int layoutBegin(XOMX_wall *w, int preset) {
+   unsigned int i;
+   int n=0;
+
+   w->preset=preset;
+   w->deadline=nowUs()+layoutRevealMs*1000LL;
+   if (__atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST)==0)
+      __atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+   for (i=0; i<LENGTH(w->pid); i++) {
+      if (wallAlive(w, i) && kill(w->pid[i], SIGUSR1)==0)
+         n++;
+   }
+   return n;
+}
+
+/* xomxplayer --layout <n> */
+static int layoutCommand(int preset) {
+   char path[64];
+   XOMX_wall *w;
+   int n;
+
+   if (preset < 0 || preset >= (int)LENGTH(layouts)) {
+      fprintf(stderr, "Layout: %i isn't a preset (0-%i).\n", preset, (int)LENGTH(layouts)-1);
+      return 1;
+   }
+   if ((w=wallOpen())==NULL) {
+      wallPath(path, sizeof(path));
+      fprintf(stderr, "Layout: can't open %s (%s).\n", path, strerror(errno));
+      return 1;
+   }
+   if ((n=layoutBegin(w, preset))==0) {
+      fprintf(stderr, "Layout: no slots running.\n");
+      return 1;
+   }
+   printf("Layout %i: %i slots switched.\n", preset, n);
+   return 0;
+}
+
+static void layoutDone(void) {
+   __atomic_store_n(&wall->done[layoutSlot], layoutSeq, __ATOMIC_SEQ_CST);
+}
+
+/* Move this slot to its place in the layout the wall is switching to (after SIGUSR1) */
+static void layoutApply(float sx, float sy) {
+   const XOMX_rect *r;
+   int vx, vy, preset;
+   unsigned int vw, vh;
+
+   layoutWanted=0;
+   if (wall==NULL || (layoutSeq=__atomic_load_n(&wall->seq, __ATOMIC_SEQ_CST))==0)
+      return;
+   preset=wall->preset;
+   if (preset < 0 || preset >= (int)LENGTH(layouts)) {
+      layoutSeq=0;
+      return;
+   }
+   layoutBegan=nowUs();
+   layoutPid=0;
+   layoutReplacing=0;
+   r=&layouts[preset][layoutSlot];
+   if (r->w==0) {   /* Not in this layout */
+      if (omxplayer_pid > 0 && !videoHidden)
+         spawn(hide_video);
+      visibilityAccount();
+      videoHidden=1;   /* Shown again by VisibilityNotify when win is mapped */
+      visPending=-1;
+      if (dis!=NULL)
+         XUnmapWindow(dis, win);
+      layoutDone();
+      layoutSeq=0;
+      return;
+   }
+   vx=r->x;
+   vy=r->y;
+   vw=r->w;
+   vh=r->h;
+#ifdef XOMX_SNAP
+   snapRect(&vx, &vy, &vw, &vh);
+#endif
+   snprintf(winParam, sizeof(winParam), "%i %i %i %i", vx, vy, vx+vw, vy+vh);
+   if (r->file!=NULL && playlist!=NULL && strcmp(r->file, playlist[playlistCur])) {   /* New file: starts at the new place */
+      if (omxplayer_pid > 0 && !videoHidden)   /* Not left at the old place until it has quit */
+         spawn(hide_video);
+      layoutList[0]=(char *)r->file;
+      playlistSwitch(layoutList, 1, omxplayer_pid > 0);
+      layoutReplacing=(replacePid > 0);
+   }
+   else if (omxplayer_pid > 0) {
+      if (!videoHidden && !layoutHidden) {
+         mosaicSend(hide_video, 1);
+         layoutHidden=1;
+      }
+      if (tileCount > 0)
+         layoutPid=mosaicLayout(r->x, r->y, r->w, r->h, 1);
+      else {
+         snprintf(resizeParam, sizeof(resizeParam), "string:%s", winParam);
+         layoutPid=spawn(resize_player);
+      }
+   }
+   if (layoutPid <= 0 && !layoutReplacing)
+      layoutDone();
+   if (dis!=NULL) {
+      layoutGeom.x=r->x*sx+0.5;
+      layoutGeom.y=r->y*sy+0.5;
+      layoutGeom.w=r->w*sx+0.5;
+      layoutGeom.h=r->h*sy+0.5;
+      XMapWindow(dis, win);
+      if (geom.frame!=None)   /* The window manager places the frame's outer corner */
+         XMoveResizeWindow(dis, win, layoutGeom.x-geom.offX-geom.frameBw, layoutGeom.y-geom.offY-geom.frameBw, layoutGeom.w, layoutGeom.h);
+      else
+         XMoveResizeWindow(dis, win, layoutGeom.x, layoutGeom.y, layoutGeom.w, layoutGeom.h);
+      XFlush(dis);
+   }
+}
+
+/* Called for each child reaped */
+static void layoutReaped(pid_t chld_pid) {
+   if (layoutPid > 0 && chld_pid==layoutPid) {
+      layoutPid=0;
+      layoutDone();
+   }
+}
+
+/* The ConfigureNotify is for the switch's own move, which has been sent already */
+static int layoutMoved(void) {
+   return layoutGeom.w > 0 && geom.x==layoutGeom.x && geom.y==layoutGeom.y && geom.w==layoutGeom.w && geom.h==layoutGeom.h;
+}
+
+/* Show the video once every slot has moved. Returns microseconds until it should be looked at again, -1 if no switch */
+static long long layoutRun(void) {
+   long long t=nowUs(), left;
+   unsigned int i;
+   int preset;
+
+   if (layoutSeq==0)
+      return -1;
+   if (layoutReplacing && replacePid <= 0) {   /* The new player has been started (or couldn't be) */
+      layoutReplacing=0;
+      layoutDone();
+   }
+   preset=wallPreset(wall);
+   for (i=0; i<LENGTH(wall->pid); i++) {
+      if (layouts[preset][i].w > 0 && __atomic_load_n(&wall->done[i], __ATOMIC_SEQ_CST)!=layoutSeq && wallAlive(wall, i))
+         break;
+   }
+   if (i < LENGTH(wall->pid) && (left=wall->deadline-t) > 0)
+      return (left < 5000) ? left : 5000;
+   if (layoutHidden && !videoHidden && omxplayer_pid > 0)
+      mosaicSend(unhide_video, 0);
+   layoutHidden=0;
+   layoutSwitches++;
+   layoutUs+=t-layoutBegan;
+   tuneLog("layout %i slot %i shown %lli ms after the switch%s\n", preset, layoutSlot, (t-layoutBegan)/1000,
+      (i < LENGTH(wall->pid)) ? ", timed out" : "");
+   layoutSeq=0;
+   return -1;
+}
+
+/* Audio elision: only one player is heard - the focused tile of a mosaic, wallAudioSlot of a wall, and (muteHidden)
+ * not while the window is obscured. The others are muted at once, and once they haven't been heard for audioElideMs
+ * are restarted at their position with --aidx -1, so they don't decode or mix audio at all. A player which is to be
+ * heard again is unmuted, or restarted with audio at its position if it had none. The hold means focus going back and
+ * forth doesn't restart anything. Players' CPU time is in the metrics, labelled with whether they decode audio.
+ * Nothing here waits: a restart sends Quit and the player is started again when the main loop reaps it (or killed
+ * after 3 seconds), at the position worked out from the wall clock. One is restarted with audio only once it has been
+ * heard for audioSettleMs, and no player more often than every audioGapMs, so flicking the focus across a mosaic
+ * doesn't restart every tile on the way. Paused players are left alone.
+ */
+static unsigned long audioElided, audioRestored;
+
+static int tileHeard(int i) {
+   if (tileCount > 0 && i!=tileFocus)
+      return 0;
+   if (layoutSlot >= 0 && layoutSlot!=wallAudioSlot)
+      return 0;
+   return !(muteHidden && videoHidden);
+}
+
+static long long audioQuit[LENGTH(tiles)];    /* When player i was told to quit for a restart, 0 if it wasn't, -1 once killed */
+static long long audioLast[LENGTH(tiles)];    /* Its last restart */
+static long long audioHeard[LENGTH(tiles)];   /* Since when it has been heard, 0 if it isn't */
+
+/* Players being restarted or replaced */
+static int audioPending(void) {
+   unsigned int i;
+   int n=(replacePid > 0);
+
+   for (i=0; i<LENGTH(tiles); i++)
+      n+=(audioQuit[i]!=0);
+   return n;
+}
+
+/* Quit player i to restart it with audio or without; audioReaped() starts it again once it has gone */
+static void audioRestart(int i, int audio) {
+   double cpu=0;
+   long rss=0;
+
+   playerUsage((i==0) ? omxplayer_pid : tiles[i].pid, &cpu, &rss);
+   tuneLog("audio %s %s at %.1fs, %.1fs CPU so far\n", audio ? "on" : "off", (i==0) ? sourceFile : tiles[i].file, tilePosition(i), cpu);
+   tiles[i].audio=audio;
+   tiles[i].muted=0;
+   audioLast[i]=nowUs();
+   if (i==0) {   /* Restarted where it has got to by then, see replaceReaped() */
+      audioOff=!audio;
+      playerQuit(0);
+      playerReplace(-1);
+      return;
+   }
+   tileSend(i, quit_player);
+   audioQuit[i]=audioLast[i];
+}
+
+/* A child has been reaped: if it was a tile quit by audioRestart(), start it again where it has got to by now.
+ * One which has got to the end isn't, and is left to end as it would have. omxplayer itself is replaceReaped()'s.
+ */
+static void audioReaped(pid_t chld_pid) {
+   int i;
+   double pos;
+
+   for (i=1; i<tileCount; i++) {
+      if (audioQuit[i]==0 || chld_pid!=tiles[i].pid)
+         continue;
+      audioQuit[i]=0;
+      pos=tilePosition(i);
+      if (tiles[i].probe.duration <= 0 || pos < tiles[i].probe.duration)
+         tileStart(i, pos);
+      return;
+   }
+}
+
+/* Apply the policy. Returns microseconds until a player is due to be restarted or killed, -1 if none is */
+static long long audioRun(void) {
+   long long t=nowUs(), next=-1, left;
+   int i, can, n=(tileCount > 0) ? tileCount : 1;
+
+   for (i=0; i<n; i++) {
+      if (i==0 && tiles[0].pid!=omxplayer_pid) {   /* Started since: the next item, a rendition, a restart */
+         tiles[0].pid=omxplayer_pid;
+         tiles[0].audio=!audioOff;
+         tiles[0].muted=0;
+      }
+      if (tiles[i].pid <= 0 || (i==0 && (!playerReady || replacePid > 0)))
+         continue;
+      if (audioQuit[i] > 0) {   /* Quitting, see audioReaped() */
+         if ((left=audioQuit[i]+3000000-t) > 0) {
+            if (next==-1 || left < next)
+               next=left;
+            continue;
+         }
+         fprintf(stderr, "ERROR: xomxplayer: player %i not responding, sending SIGKILL.\n", (int)tiles[i].pid);
+         kill(tiles[i].pid, SIGKILL);
+         playerKills++;
+         audioQuit[i]=-1;
+      }
+      if (audioQuit[i]!=0)
+         continue;
+      can=(tilePosition(i) >= 0 && !((i==0) ? playPaused : tilePaused[i]));   /* A restart would start a paused one playing */
+      left=audioLast[i]+audioGapMs*1000LL-t;
+      if (tileHeard(i)) {
+         tiles[i].quietSince=0;
+         if (audioHeard[i]==0)
+            audioHeard[i]=t;
+         if (tiles[i].audio) {
+            if (tiles[i].muted) {
+               tileSend(i, unmute_player);
+               tiles[i].muted=0;
+            }
+         }
+         else if (can) {   /* Once the focus has settled */
+            if (left < audioHeard[i]+audioSettleMs*1000LL-t)
+               left=audioHeard[i]+audioSettleMs*1000LL-t;
+            if (left > 0) {
+               if (next==-1 || left < next)
+                  next=left;
+            }
+            else {
+               audioRestart(i, 1);
+               audioRestored++;
+            }
+         }
+         continue;
+      }
+      audioHeard[i]=0;
+      if (!tiles[i].audio)
+         continue;
+      if (tiles[i].quietSince==0)
+         tiles[i].quietSince=t;
+      if (!tiles[i].muted) {
+         tileSend(i, mute_player);
+         tiles[i].muted=1;
+      }
+      if (audioElideMs <= 0 || !can)
+         continue;
+      if (left < tiles[i].quietSince+audioElideMs*1000LL-t)
+         left=tiles[i].quietSince+audioElideMs*1000LL-t;
+      if (left <= 0) {
+         audioRestart(i, 0);
+         audioElided++;
+      }
+      else if (next==-1 || left < next)
+         next=left;
+   }
+   return next;
+}
+
+/* Player priorities: every thread of each player (/proc/<pid>/task) gets the nice level, I/O priority and CPUs of its
+ * class in playerClass[] - watched (shown, and the focused tile of a mosaic), background (other tiles shown) or hidden.
+ * A player moving up a class is changed at once, so the one being watched always wins; moving down waits for
+ * prioDemoteMs, so focus or visibility flicking back doesn't churn. The time players' threads wait for a CPU
+ * (schedstat run delay), the leading sign of dropped frames, is sampled each second per class for the metrics, and
+ * a change is logged with the rate before and after it. Raising nice is one way for an unprivileged process, so nice
+ * is only changed if it can be brought back down to every class's: with CAP_SYS_NICE, or an RLIMIT_NICE reaching the
+ * lowest. Otherwise players keep the nice they were started with and the classes differ in I/O priority and CPUs.
+ */
+static int prioApplied[LENGTH(tiles)];      /* Class set, -1 if none */
+static pid_t prioPid[LENGTH(tiles)];        /* Player it was set for */
+static int prioWant[LENGTH(tiles)];
+static long long prioSince[LENGTH(tiles)];  /* When prioWant changed */
+static unsigned long long prioDelay[LENGTH(tiles)];   /* Last run delay total, ns */
+static double prioRate[LENGTH(tiles)];      /* ms of run delay per second, last sample */
+static double prioBefore[LENGTH(tiles)];    /* Rate before the last change, -1 once logged */
+static unsigned long long prioClassDelay[LENGTH(playerClass)];   /* Run delay of players in each class, ns */
+static unsigned long prioChanges;
+static long long prioSampled;
+static int prioNice=-1;   /* 1 if nice can be set both ways, -1 until looked at */
+
+/* Whether a player's nice could be lowered again to the lowest in playerClass[] once raised */
+static int prioNiceRestorable(void) {
+   char buf[4096], *cap;
+   unsigned long long eff;
+   struct rlimit rl;
+   unsigned int c;
+   int lowest=19;
+
+   for (c=0; c<LENGTH(playerClass); c++) {
+      if (playerClass[c].nice < lowest)
+         lowest=playerClass[c].nice;
+   }
+   if (readSmall("/proc/self/status", buf, sizeof(buf)) > 0 && (cap=strstr(buf, "\nCapEff:"))!=NULL &&
+         sscanf(cap+8, "%llx", &eff)==1 && eff>>23 & 1)   /* CAP_SYS_NICE */
+      return 1;
+   if (getrlimit(RLIMIT_NICE, &rl)==0 && (rl.rlim_cur==RLIM_INFINITY || 20-(long long)rl.rlim_cur <= lowest))
+      return 1;   /* The nice floor is 20-rlim_cur */
+   return 0;
+}
+
+static int prioClassOf(int i) {
+   if (videoHidden)
+      return 2;
+   return (tileCount > 0 && i!=tileFocus) ? 1 : 0;
+}
+
+/* Set p's threads to class c; the nice level only with nice */
+static void prioApply(pid_t p, int c, int nice) {
+   const XOMX_prio *k=&playerClass[c];
+   char path[64];
+   DIR *d;
+   struct dirent *e;
+   cpu_set_t cpus;
+   pid_t tid;
+   int i;
+
+   if (prioNice==-1 && (prioNice=prioNiceRestorable())==0)
+      fprintf(stderr, "Priority: nice left alone, it couldn't be lowered again (needs CAP_SYS_NICE or RLIMIT_NICE).\n");
+   CPU_ZERO(&cpus);
+   for (i=0; i<CPU_SETSIZE && i<(int)sizeof(k->cpus)*8; i++) {
+      if (k->cpus==0 || k->cpus>>i & 1)
+         CPU_SET(i, &cpus);
+   }
+   snprintf(path, sizeof(path), "/proc/%i/task", p);
+   if ((d=opendir(path))==NULL)
+      return;
+   while ((e=readdir(d))!=NULL) {
+      if ((tid=atoi(e->d_name)) <= 0)
+         continue;
+      if (prioNice && nice)
+         setpriority(PRIO_PROCESS, tid, k->nice);
+      syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, tid, k->ioClass<<13 | k->ioLevel);
+      sched_setaffinity(tid, sizeof(cpus), &cpus);
+   }
+   closedir(d);
+}
+
+/* Run delay of all p's threads so far, ns */
+static unsigned long long prioRunDelay(pid_t p) {
+   char path[64], buf[128];
+   unsigned long long run, wait, sum=0;
+   DIR *d;
+   struct dirent *e;
+
+   snprintf(path, sizeof(path), "/proc/%i/task", p);
+   if ((d=opendir(path))==NULL)
+      return 0;
+   while ((e=readdir(d))!=NULL) {
+      if (atoi(e->d_name) <= 0)
+         continue;
+      snprintf(path, sizeof(path), "/proc/%i/task/%.16s/schedstat", p, e->d_name);
+      if (readSmall(path, buf, sizeof(buf)) > 0 && sscanf(buf, "%llu %llu", &run, &wait)==2)
+         sum+=wait;
+   }
+   closedir(d);
+   return sum;
+}
+
+/* Apply the classes. Returns microseconds until the next demotion or sample is due */
+static long long prioRun(void) {
+   long long t=nowUs(), next=1000000-(t-prioSampled), left;
+   int i, c, n=(tileCount > 0) ? tileCount : 1, sample=(t-prioSampled >= 1000000);
+   unsigned long long delay;
+   pid_t p;
+
+   for (i=0; i<n; i++) {
+      p=(i==0) ? omxplayer_pid : tiles[i].pid;
+      if (p <= 0 || (i==0 && !playerReady))   /* Once up, so the threads it starts are there */
+         continue;
+      if (p!=prioPid[i]) {   /* New player */
+         prioPid[i]=p;
+         prioApplied[i]=-1;
+         prioDelay[i]=prioRunDelay(p);
+         prioBefore[i]=-1;
+      }
+      if ((c=prioClassOf(i))!=prioWant[i] || prioApplied[i]==-1) {
+         prioWant[i]=c;
+         prioSince[i]=t;
+      }
+      if (c!=prioApplied[i]) {
+         if (prioApplied[i]!=-1 && c > prioApplied[i] && (left=prioSince[i]+prioDemoteMs*1000LL-t) > 0) {
+            if (left < next)
+               next=left;
+         }
+         else {
+            prioApply(p, c, 1);
+            if (prioApplied[i]!=-1) {
+               prioChanges++;
+               prioBefore[i]=prioRate[i];
+               tuneLog("priority %s class %i -> %i\n", (i==0) ? sourceFile : tiles[i].file, prioApplied[i], c);
+            }
+            prioApplied[i]=c;
+         }
+      }
+      if (sample) {
+         delay=prioRunDelay(p);
+         if (delay >= prioDelay[i] && prioApplied[i]!=-1) {
+            prioClassDelay[prioApplied[i]]+=delay-prioDelay[i];
+            prioRate[i]=(double)(delay-prioDelay[i])/(t-prioSampled);   /* ns per us: ms/s */
+            if (prioBefore[i] >= 0) {   /* First second after a change */
+               tuneLog("priority %s class %i run delay %.1f ms/s, was %.1f\n", (i==0) ? sourceFile : tiles[i].file,
+                  prioApplied[i], prioRate[i], prioBefore[i]);
+               prioBefore[i]=-1;
+            }
+         }
+         prioDelay[i]=delay;
+      }
+   }
+   if (sample) {
+      prioSampled=t;
+      next=1000000;
+   }
+   return (next > 0) ? next : 0;
+}
+
+/* Warm player: while an item plays, the next one in the playlist is started in the background - fully transparent
+ * (--alpha 0), silent, with the I/O priority and CPUs of the lowest class - and paused at its start once it answers on
+ * dbus. Its nice is left as ours: the hold keeps it idle, and a player which had been reniced might never get back.
+ * When the item ends the warm player is claimed: moved to the window, made opaque and played, so omxplayer's start up
+ * (OMX set up, fonts, opening and buffering the file) is done before it is needed. A claim for another file than
+ * the warm one (the schedule changed, a break came) is made with OpenUri, which reopens the file in the running player
+ * (without the per file tuning of buildPlayerArgs()). A generic player idling on a blank clip isn't kept: poolNext()
+ * has a file whenever anything is to play next, and warming that one also has it opened and buffered. It has the other of two
+ * dbus names and layers, which are swapped with the playing ones on a claim. It is only started while MemAvailable
+ * leaves poolMinFreeMB beyond a player's size and memory pressure (PSI some avg10) is under poolMaxPressure, and is
+ * dropped if pressure rises. Nothing here waits: whether it answers, the pause and the seek to the start are each sent
+ * when the last has been reaped, and a dropped player is told to quit and reaped by the main loop (killed after 3
+ * seconds); another isn't started until it has gone, as it has the dbus name.
+ */
+static pid_t poolPid;
+static char poolFile[4096];
+static int poolReady;            /* Answered on dbus and paused */
+static long long poolStarted;
+static char poolDbus[128];       /* Names and layer for the warm player */
+static char poolDest[256];
+static char poolLayer[16];
+static unsigned long poolStarts, poolClaims, poolDrops;
+static pid_t poolRetired;        /* Player quitting after a switch to the warm one, until it is reaped */
+static pid_t poolCmd;            /* dbus command to the warm player being waited for, 0 if none */
+static int poolStep;             /* What poolCmd is: 0 asks for the position, 1 pauses, 2 seeks to the start */
+static pid_t poolDropping;       /* Dropped warm player, until it is reaped */
+static long long poolDropAt;     /* When it was told to quit, -1 once killed */
+static const char *alpha_opaque[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.SetAlpha", "objpath:/not/used", "int64:255", NULL };
+static const char *volume_full[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.freedesktop.DBus.Properties.Volume", "double:1.0", NULL };
+static char uriParam[4200];      /* string:<file> for open_uri */
+static const char *open_uri[]={ "dbus-send", "--print-reply", "--reply-timeout=1000", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.OpenUri", uriParam, NULL };
+
+/* After initNames() */
+static void poolNames(void) {
+   snprintf(poolDbus, sizeof(poolDbus), "%.100s_w", dbusParam);
+   snprintf(poolDest, sizeof(poolDest), "--dest=%.100s_w", dbusParam);
+   snprintf(poolLayer, sizeof(poolLayer), "%i", atoi(layerParam)-1);
+}
+
+static void poolSwapNames(void) {
+   char dbus[sizeof(dbusParam)], dest[sizeof(destParam)], layer[sizeof(layerParam)];
+
+   memcpy(dbus, dbusParam, sizeof(dbus));
+   memcpy(dest, destParam, sizeof(dest));
+   memcpy(layer, layerParam, sizeof(layer));
+   memcpy(dbusParam, poolDbus, sizeof(dbus));
+   memcpy(destParam, poolDest, sizeof(dest));
+   memcpy(layerParam, poolLayer, sizeof(layer));
+   memcpy(poolDbus, dbus, sizeof(dbus));
+   memcpy(poolDest, dest, sizeof(dest));
+   memcpy(poolLayer, layer, sizeof(layer));
+}
+
+/* Is there memory for another player? */
+static int poolRoom(void) {
+   char buf[4096], *p;
+   long avail=-1, rss=0;
+   double cpu, some=0;
+
+   if (readSmall("/proc/meminfo", buf, sizeof(buf)) > 0 && (p=strstr(buf, "MemAvailable:"))!=NULL)
+      avail=atol(p+13);
+   if (readSmall("/proc/pressure/memory", buf, sizeof(buf)) > 0 && (p=strstr(buf, "some avg10="))!=NULL)
+      some=atof(p+11);   /* No PSI (older kernels): MemAvailable only */
+   if (omxplayer_pid > 0)
+      playerUsage(omxplayer_pid, &cpu, &rss);
+   return avail >= 0 && avail/1024 >= poolMinFreeMB+rss/1024 && some < poolMaxPressure;
+}
+
+static void poolStart(const char *file) {
+   char source[sizeof(sourceFile)], video[sizeof(videoFile)];
+   XOMX_probe keep=probe;
+   int j;
 
-#define LENGTH(X) (sizeof X / sizeof X[0])
-#define XOMX_FB_DEV "/dev/fb0"
-#define DEBUG
+   memcpy(source, sourceFile, sizeof(source));
+   memcpy(video, videoFile, sizeof(video));
+   poolSwapNames();
+   snprintf(sourceFile, sizeof(sourceFile), "%s", file);
+   snprintf(videoFile, sizeof(videoFile), "%s", file);
+   probeFile(sourceFile, &probe);
+   buildPlayerArgs(0);
+   for (j=0; playerArgs[j]!=NULL; j++)
+      ;
+   playerArgs[j+3]=playerArgs[j-1];   /* The file stays last */
+   playerArgs[j-1]="--alpha";
+   playerArgs[j]="0";
+   playerArgs[j+1]="--vol";
+   playerArgs[j+2]="-6000";
+   playerArgs[j+4]=NULL;
+   poolPid=spawn(playerArgs);
+   if (poolPid > 0)
+      prioApply(poolPid, LENGTH(playerClass)-1, 0);
+   poolSwapNames();
+   memcpy(sourceFile, source, sizeof(source));
+   memcpy(videoFile, video, sizeof(video));
+   probe=keep;
+   snprintf(poolFile, sizeof(poolFile), "%s", file);
+   poolReady=0;
+   poolCmd=0;
+   poolStep=0;
+   poolStarted=nowUs();
+   poolStarts++;
+}
 
-/* For framebuffer info */
-#ifdef XOMX_FB_DEV
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <linux/fb.h>
-#endif
-/* End of framebuffer info */
+/* Send cmd to the warm player, its reply to be reaped by poolReaped() */
+static void poolSend(const char **cmd) {
+   poolSwapNames();
+   poolCmd=spawn(cmd);
+   poolSwapNames();
+}
 
-typedef struct {
-   KeySym keysym;
-   const char **v;
-} XOMX_key;
+/* Wait up to 3 seconds for a warm player told to quit, then kill it */
+static void poolWait(pid_t pid) {
+   int n, status;
+   pid_t r=0;
 
-static Display *dis;
-static Window win;
-/* Command variables for config */
-static char pid[16];
-static char dbusParam[128];    /* Store for dbus name parameter */
-static char destParam[256];    /* dest parameter for dbus constol */
-static char winParam[32];      /* Requested OMX window size */
-static char resizeParam[64];   /* Resize parameter for dbus control */
-static char videoFile[4096];   /* File to play with path */
-Atom wmDeleteMessage;
+   for (n=0; n<30 && (r=waitpid(pid, &status, WNOHANG))==0; n++)
+      usleep(100000);
+   if (n==30) {
+      kill(pid, SIGKILL);
+      r=waitpid(pid, &status, 0);
+      playerKills++;
+   }
+   if (r==pid)
+      childExited(status);
+}
 
-/* Config */
-static char className[] = "xomxplayer";
-static const char omxplayerFont[]="/usr/share/fonts/TTF/Vera.ttf";
-static const char omxplayerItFont[]="/usr/share/fonts/TTF/VeraIt.ttf";
+/* Quit the warm player. It is reaped by the main loop, or with wait (exit, upgrade) here */
+static void poolDrop(int wait) {
+   if (poolPid <= 0 && !(wait && poolDropping > 0))
+      return;
+   if (poolPid > 0) {
+      poolSwapNames();
+      spawn(quit_player);
+      poolSwapNames();
+      poolDropping=poolPid;   /* None before: another isn't started until it has gone */
+      poolDropAt=nowUs();
+      poolPid=0;
+      poolCmd=0;
+      poolReady=0;
+      poolDrops++;
+   }
+   if (wait) {
+      poolWait(poolDropping);
+      poolDropping=0;
+   }
+}
 
-/* Commands to run omxplayer, quit omxplayer and resize / reposition the window. These must be present
- * opengl kms driver requires --no-osd and remove "--sid", "1" and font args
+/* The file to play next: the first of a schedule entry due within poolAheadS, else the next playlist item, else
+ * at the end of the playlist the one the schedule goes back to. NULL if none is known.
  */
-static const char *omxplayer[]={ "omxplayer.bin", "--font", omxplayerFont, "--italic-font", omxplayerItFont, "--sid", "1", "--no-keys", "--dbus_name", dbusParam, "--layer", pid, "--win", winParam, "--aspect-mode", "Letterbox", videoFile, NULL };
-static const char *quit_player[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Quit", NULL };
-static const char *resize_player[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.VideoPos", "objpath:/not/used", resizeParam, NULL };
-static const char *hide_video[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:28", NULL };
-static const char *unhide_video[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:29", NULL };
+static const char *poolNext(void) {
+   XOMX_sched *soon=NULL;
+   time_t t=time(NULL);
+   int i;
 
-/* Other dbus commands 
- * See https://github.com/popcornmix/omxplayer/blob/master/README.md
+   if (playlist==NULL)
+      return NULL;
+   for (i=0; i<schedCount; i++) {
+      if (scheds[i].due-t <= poolAheadS && (soon==NULL || scheds[i].due < soon->due))
+         soon=&scheds[i];
+   }
+   if (soon!=NULL)
+      return soon->files[0];
+   if (playlistCur+1 < playlistLen)
+      return playlist[playlistCur+1];
+   if (schedCount > 0)
+      return (schedCur!=NULL && schedCur->every > 0 && schedBase!=NULL) ? schedBase->files[0] : playlist[0];
+   return NULL;
+}
+
+static long long poolWarm(void) {
+   const char *next=poolNext();
+
+   if (poolSize <= 0)
+      return -1;
+   if (poolPid > 0) {
+      if (next==NULL || strcmp(poolFile, next)) {
+         poolDrop(0);   /* The playlist or what is due has changed */
+         return (next!=NULL) ? 1000000 : -1;
+      }
+      if (!poolRoom()) {
+         tuneLog("pool %s dropped, memory\n", poolFile);
+         poolDrop(0);
+         return -1;
+      }
+      if (poolReady)
+         return -1;
+      if (poolCmd <= 0 && poolStep==0)   /* Up yet? Asked again until it answers */
+         poolSend(get_position);
+      return 100000;
+   }
+   if (omxplayer_pid <= 0 || !playerReady || tileCount > 0)
+      return -1;
+   if (next==NULL)   /* A schedule entry may come within poolAheadS */
+      return (schedCount > 0) ? 1000000 : -1;
+   if (poolRetired > 0 || poolDropping > 0 || !poolRoom())
+      return 1000000;   /* The dbus name is free once the old player has gone */
+   poolStart(next);
+   return 100000;
+}
+
+/* Start, pause or drop the warm player. Returns microseconds until it should be looked at again, -1 if there is none */
+static long long poolRun(void) {
+   long long warm=poolWarm(), left;
+
+   if (poolDropping <= 0 || poolDropAt < 0)
+      return warm;
+   if ((left=poolDropAt+3000000-nowUs()) > 0)
+      return (warm >= 0 && warm < left) ? warm : left;
+   fprintf(stderr, "ERROR: xomxplayer: warm omxplayer not responding, sending SIGKILL.\n");
+   kill(poolDropping, SIGKILL);
+   playerKills++;
+   poolDropAt=-1;
+   return warm;
+}
+
+/* Play sourceFile (the next item, just loaded) on the warm player if it has it. Returns 1 if it did */
+static int poolClaim(void) {
+   long long t=nowUs();
+   int status;
+
+   if (poolPid <= 0)
+      return 0;
+   if (waitpid(poolPid, &status, WNOHANG)==poolPid) {   /* Died while warm */
+      childExited(status);
+      poolPid=0;
+      return 0;
+   }
+   if (!poolReady) {
+      poolDrop(0);
+      return 0;
+   }
+   poolSwapNames();
+   omxplayer_pid=poolPid;
+   poolPid=0;
+   if (strcmp(poolFile, sourceFile)) {   /* Warmed on something else: reopen in place */
+      snprintf(uriParam, sizeof(uriParam), "string:%s", sourceFile);
+      spawnWait(open_uri);
+   }
+   snprintf(resizeParam, sizeof(resizeParam), "string:%s", winParam);
+   spawnWait(resize_player);
+   spawnWait(alpha_opaque);
+   if (!audioOff)
+      spawnWait(volume_full);
+   spawn(play_player);
+   playerBegan(0);
+   poolClaims++;
+   tuneLog("pool %s claimed%s in %lli ms\n", sourceFile, strcmp(poolFile, sourceFile) ? " with OpenUri" : "", (nowUs()-t)/1000);
+   return 1;
+}
+
+/* Switch to schedule entry e (NULL: the current list again from the start) and play it, on the warm player if
+ * there is one. Then the playing omxplayer is only told to quit and is reaped by the main loop, so the switch waits
+ * neither for it to stop nor for a cold start.
  */
-static const char *pause_player[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:16", NULL };
-static const char *stop_player[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:15", NULL };
-static const char *seek_back_small[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:19", NULL };
-static const char *seek_forward_small[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:20", NULL };
-static const char *seek_back_large[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:21", NULL };
-static const char *seek_forward_large[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:22", NULL };
-static const char *toggle_subtitle[]={ "dbus-send", "--type=method_call", "--session", destParam, "/org/mpris/MediaPlayer2", "org.mpris.MediaPlayer2.Player.Action", "int32:12", NULL };
+static void poolSwitch(XOMX_sched *e) {
+   pid_t p;
+   int status;
 
-/* See /usr/include/X11/keysymdef.h for keycodes */
-static KeySym quitKey=XK_q;
-static KeySym fullScreenKey=XK_f;
-static XOMX_key keys[]= {
-   { XK_p,         pause_player },
-   { XK_s,         stop_player },
-   { XK_Left,      seek_back_small },
-   { XK_Right,     seek_forward_small },
-   { XK_Page_Up,   seek_forward_large },
-   { XK_Page_Down, seek_back_large },
-   { XK_v,         toggle_subtitle },
-};
+   if (poolPid > 0 && (p=waitpid(poolPid, &status, WNOHANG))!=0) {   /* Died while warm */
+      if (p==poolPid)
+         childExited(status);
+      poolPid=0;
+   }
+   if (poolPid <= 0 || !poolReady) {
+      schedSwitch(e, 1);
+      return;
+   }
+   if (omxplayer_pid > 0) {
+      spawn(quit_player);
+      playLogged(playEnded, 0);
+      poolRetired=omxplayer_pid;
+      omxplayer_pid=0;
+   }
+   schedSwitch(e, 0);
+   if (!poolClaim()) {
+      startPlayer(0);
+      if (dis!=NULL)
+         showPoster();
+   }
+   if (dis!=NULL)
+      XStoreName(dis, win, sourceFile);
+}
 
-/* Adapted from dwm spawn() (http://suckless.org/) */
-static pid_t spawn(const char **arg) {
-   pid_t chld_pid;
-#ifdef DEBUG
-   int i=0;
-   fprintf(stderr, "exec ");
-   while (arg[i]!=NULL) {
-      fprintf(stderr, "%s ",arg[i]);
-      i++;
+/* Called for each child reaped */
+static void poolReaped(pid_t chld_pid, int status) {
+   if (poolPid > 0 && chld_pid==poolPid) {
+      poolPid=0;
+      poolCmd=0;
    }
-   fprintf(stderr, "\n");
-#endif
-   chld_pid=fork();
-   if (chld_pid==0) {
-      if (dis)
-         close(ConnectionNumber(dis));
-      setsid();
-      execvp(((char **)arg)[0], (char **)arg);
-      fprintf(stderr, "xomxplayer: execvp %s", ((char **)arg)[0]);
-      perror(" failed");
-      exit(EXIT_SUCCESS);
+   if (poolRetired > 0 && chld_pid==poolRetired)
+      poolRetired=0;
+   if (poolDropping > 0 && chld_pid==poolDropping)
+      poolDropping=0;
+   if (poolCmd <= 0 || chld_pid!=poolCmd)
+      return;
+   poolCmd=0;
+   if (poolStep==0) {   /* Up: hold it at the start */
+      if (WIFEXITED(status) && WEXITSTATUS(status)==0) {
+         poolStep=1;
+         poolSend(pause_player);
+      }
+   }
+   else if (poolStep==1) {
+      poolStep=2;
+      snprintf(setPosParam, sizeof(setPosParam), "int64:0");
+      poolSend(set_position);
+   }
+   else {
+      poolReady=1;
+      tuneLog("pool %s ready in %lli ms\n", poolFile, (nowUs()-poolStarted)/1000);
    }
-   return chld_pid;
 }
 
-static void xhints(float sx, float sy) {
-   XClassHint class = {className, className};
-   XWMHints wm = {.flags = InputHint, .input = 1};
-   XSizeHints *sizeh = NULL;
+/* Live upgrade (SIGUSR2): the running omxplayer and win are handed over to a new exec of the installed binary, which
+ * adopts them (--adopt <fd>). The state goes in a memfd left open across execve. The X server keeps win after the
+ * old connection closes (RetainTemporary) until the new process has made its own in the same place (see adoptX()),
+ * and omxplayer is never touched: the pid doesn't change, so it is still our child. The gap, from the signal being
+ * handled to the new process having the window, is logged.
+ * The state starts with a magic, version and length. Fields are only ever added at the end (bumping handoverVersion),
+ * so a handover written by an older binary is shorter and what it lacks is read as zero.
+ */
+typedef struct {
+   unsigned int magic;     /* handoverMagic */
+   unsigned int version;   /* handoverVersion of the writer */
+   unsigned int length;    /* sizeof(XOMX_handover) of the writer */
+   XOMX_session s;         /* Playlist, position, pause, geometry, hidden, layer */
+   long long start;        /* nowUs() when the handover began */
+   pid_t player;
+   long long playerStart;
+   int playerReady;
+   int running;            /* main()'s omxplayerRunning */
+   Window win;             /* None if there was no display */
+   XOMX_geom geom;
+   int wx, wy;             /* main()'s window geometry, omxplayer coordinates */
+   unsigned int ww, wh;
+   char winParam[32];
+   char source[4096];      /* sourceFile, which may be a rendition */
+   unsigned long visEvents, visCmds, sessionWrites;
+   long long visSince;
+   unsigned int stageHits, stageLaunches;
+   long long playStartReal;   /* For the proof of play record */
+   double playStartPos;
+   int playPauses, playSeeks, playHides;
+   int slot;                  /* Wall slot, -1 if none */
+   XOMX_tile tiles[LENGTH(tiles)];
+   int tileCount, tileFocus;
+   char schedule[4096];       /* schedFile */
+   int schedCur;              /* Index in the schedule, -1 for the command line files */
+   double tilePos[LENGTH(tiles)];   /* Version 2 */
+   long long tileAnchor[LENGTH(tiles)];
+   int tilePaused[LENGTH(tiles)];
+} XOMX_handover;
 
-   sizeh = XAllocSizeHints();
-   sizeh->flags = PSize | PMinSize | PMaxSize ;
-   sizeh->height = (int)(576*sx);
-   sizeh->width = (int)(1024*sy);
-   sizeh->min_width=(int)(320*sx);
-   sizeh->min_height=(int)(240*sy);
-   sizeh->max_width=(int)(1920*sx);
-   sizeh->max_height=(int)(1080*sy);
+static const unsigned int handoverMagic=0x584f4d48, handoverVersion=2;
+static XOMX_handover handover;
+static volatile sig_atomic_t upgradeWanted;
 
-   XSetWMProperties(dis, win, NULL, NULL, NULL, 0, sizeh, &wm, &class);
-   XFree(sizeh);
+static void upgradeSignal(int sig) {
+   upgradeWanted=1;
 }
 
-static void toggleFS() {
-   XEvent fsToggle;
+/* Fills in the rest of h (main() has done its part) and execs. Returns only if that fails */
+static void upgrade(XOMX_handover *h, char *argv0) {
+   char fdParam[16];
+   char *args[]={ argv0, "--adopt", fdParam, NULL };
+   char exe[PATH_MAX];
+   ssize_t n;
+   int fd;
 
-   memset(&fsToggle, 0, sizeof(fsToggle));
-   fsToggle.type = ClientMessage;
-   fsToggle.xclient.window = win;
-   fsToggle.xclient.message_type = XInternAtom(dis, "_NET_WM_STATE", False);
-   fsToggle.xclient.format = 32;
-   fsToggle.xclient.data.l[0] = 2; /* Toggle full screen mode */
-   fsToggle.xclient.data.l[1] = XInternAtom(dis, "_NET_WM_STATE_FULLSCREEN", False);
-   fsToggle.xclient.data.l[2] = 0;
-   XSendEvent (dis, DefaultRootWindow(dis), False,
-   SubstructureRedirectMask | SubstructureNotifyMask, &fsToggle);
+   h->magic=handoverMagic;
+   h->version=handoverVersion;
+   h->length=sizeof(*h);
+   h->start=nowUs();
+   poolDrop(1);   /* Not handed over: the new process warms its own */
+   sessionFill();
+   h->s=sessionNow;
+   h->player=omxplayer_pid;
+   h->playerStart=playerStart;
+   h->playerReady=playerReady;
+   h->win=(dis!=NULL) ? win : None;
+   h->geom=geom;
+   snprintf(h->winParam, sizeof(h->winParam), "%s", winParam);
+   snprintf(h->source, sizeof(h->source), "%s", sourceFile);
+   h->visEvents=visEvents;
+   h->visCmds=visCmds;
+   h->visSince=visSince;
+   h->sessionWrites=sessionWrites;
+   h->stageHits=stageHits;
+   h->stageLaunches=stageLaunches;
+   h->playStartReal=playStartReal;
+   h->playStartPos=playStartPos;
+   h->playPauses=playPauses;
+   h->playSeeks=playSeeks;
+   h->playHides=playHides;
+   h->slot=layoutSlot;
+   memcpy(h->tiles, tiles, sizeof(tiles));
+   h->tileCount=tileCount;
+   h->tileFocus=tileFocus;
+   memcpy(h->tilePos, tilePos, sizeof(tilePos));
+   memcpy(h->tileAnchor, tileAnchor, sizeof(tileAnchor));
+   memcpy(h->tilePaused, tilePaused, sizeof(tilePaused));
+   snprintf(h->schedule, sizeof(h->schedule), "%s", schedFile);
+   h->schedCur=(schedCur!=NULL) ? (int)(schedCur-scheds) : -1;
+   if ((fd=memfd_create("xomxplayer-handover", 0))==-1 || write(fd, h, sizeof(*h))!=sizeof(*h)) {
+      fprintf(stderr, "Upgrade: can't save the state (%s).\n", strerror(errno));
+      if (fd!=-1)
+         close(fd);
+      return;
+   }
+   snprintf(fdParam, sizeof(fdParam), "%i", fd);
+   saveCmdStats();
+   playLogStop();
+   if (dis!=NULL) {
+      if (posterShown)
+         hidePoster();
+      XSetCloseDownMode(dis, RetainTemporary);
+      XSync(dis, False);
+      fcntl(ConnectionNumber(dis), F_SETFD, FD_CLOEXEC);
+   }
+   /* The path this binary was run from: /proc/self/exe itself is the old file if a new one has been installed over it */
+   if ((n=readlink("/proc/self/exe", exe, sizeof(exe)-1)) > 0) {
+      exe[n]='\0';
+      if (n > 10 && !strcmp(exe+n-10, " (deleted)"))
+         exe[n-10]='\0';
+   }
+   else
+      snprintf(exe, sizeof(exe), "/proc/self/exe");
+   execv(exe, args);
+   fprintf(stderr, "Upgrade: can't exec %s (%s).\n", exe, strerror(errno));
+   if (dis!=NULL)
+      XSetCloseDownMode(dis, DestroyAll);
+   close(fd);
+   playLogStart();
 }
 
-/* Adapted from dwm keypress() (http://suckless.org/)
- * Returns updated omxplayerRunning
+/* Read the handover from fd and take on its state. Returns main()'s omxplayerRunning, 0 on failure, when the
+ * handed over omxplayer (if it is known) has been stopped so main() can start afresh.
  */
-static int keypress(XEvent *e) {
-   unsigned int i;
-   KeySym keysym;
-   XKeyEvent *ev;
+static int adopt(int fd) {
+   size_t n=offsetof(XOMX_handover, s);
+   int i;
 
-   ev = &e->xkey;
-   keysym = XKeycodeToKeysym(dis, (KeyCode)ev->keycode, 0);
-   if (keysym==quitKey) {
-      spawn(quit_player);
-      return 0; /* Quit player */
+   memset(&handover, 0, sizeof(handover));
+   if (pread(fd, &handover, n, 0)!=(ssize_t)n || handover.magic!=handoverMagic || handover.length < sizeof(handover.s)+n) {
+      fprintf(stderr, "Upgrade: no handover state.\n");
+      close(fd);
+      return 0;
    }
-   if (keysym==fullScreenKey) {
-      toggleFS();
-      return 1; /* Don't quit player */
+   n=(handover.length < sizeof(handover)) ? handover.length : sizeof(handover);
+   if (pread(fd, &handover, n, 0)!=(ssize_t)n) {
+      close(fd);
+      return 0;
    }
-   for (i = 0; i < LENGTH(keys); i++) {
-      if (keysym==keys[i].keysym) {
-         spawn(keys[i].v);
-         break;
+   close(fd);
+   if (n < sizeof(handover))
+      fprintf(stderr, "Upgrade: handover version %u, %zu bytes of %zu.\n", handover.version, n, sizeof(handover));
+   sessionOpen(handover.slot);   /* Released by the old process at the execve */
+   if (sessionLoad(&handover.s)) {
+      if (handover.player > 0) {
+         omxplayer_pid=handover.player;
+         initNames();
+         spawn(quit_player);
+         stopPlayer();
       }
+      return 0;
    }
-   return 1;   /* Don't quit player */
+   loadItem(handover.s.item);
+   for (i=0; i<renditionCount; i++) {
+      if (!strcmp(renditions[i].file, handover.source)) {
+         renditionCur=i;
+         probe=renditions[i].info;
+         snprintf(sourceFile, sizeof(sourceFile), "%.4095s", renditions[i].file);
+      }
+   }
+   snprintf(layerParam, sizeof(layerParam), "%.15s", handover.s.layer);
+   snprintf(winParam, sizeof(winParam), "%s", handover.winParam);
+   omxplayer_pid=handover.player;
+   playerStart=handover.playerStart;
+   playerReady=handover.playerReady;
+   playPos=handover.s.pos;
+   playAnchor=handover.s.anchor;
+   playPaused=handover.s.paused;
+   videoHidden=handover.s.hidden;
+   geom=handover.geom;
+   visEvents=handover.visEvents;
+   visCmds=handover.visCmds;
+   visSince=handover.visSince;
+   sessionWrites=handover.sessionWrites;
+   stageHits=handover.stageHits;
+   stageLaunches=handover.stageLaunches;
+   playStartReal=handover.playStartReal;
+   playStartPos=handover.playStartPos;
+   playPauses=handover.playPauses;
+   playSeeks=handover.playSeeks;
+   playHides=handover.playHides;
+   layoutSlot=handover.slot;
+   memcpy(tiles, handover.tiles, sizeof(tiles));
+   tileCount=handover.tileCount;
+   tileFocus=handover.tileFocus;
+   memcpy(tilePos, handover.tilePos, sizeof(tilePos));
+   memcpy(tileAnchor, handover.tileAnchor, sizeof(tileAnchor));   /* Zero, not known, from version 1 */
+   memcpy(tilePaused, handover.tilePaused, sizeof(tilePaused));
+   audioOff=!tiles[0].audio;
+   snprintf(schedFile, sizeof(schedFile), "%s", handover.schedule);
+   if (schedFile[0] && schedLoad(schedFile)==0) {
+      schedBase=schedAnchor(time(NULL));
+      if (handover.schedCur >= 0 && handover.schedCur < schedCount)
+         schedCur=&scheds[handover.schedCur];
+   }
+   return handover.running;
 }
 
-static int initX(char *file, float sx, float sy) {
-   strncpy(videoFile, file, 4095);
-   snprintf(pid,15,"%i",getpid());
-   strncpy(dbusParam, "org.mpris.MediaPlayer2.omxplayer", 96);
-   strncat(dbusParam, pid, 8);
-   strncpy(destParam, "--dest=", 8);
-   strncat(destParam, dbusParam, 128);
+/* Metrics for node-exporter's textfile collector: every metricsMs the counters are written (Prometheus text format)
+ * to metricsDir/xomxplayer-<pid>.prom, through a temporary file and rename() so a scrape never sees half a file.
+ * The text is built in a static buffer and written with plain syscalls; nothing is allocated.
+ */
+static unsigned long moveEvents, moveCmds, moves;   /* ConfigureNotify events, the VideoPos etc. they cost, moves */
+static char metricsBuf[16384];
+static size_t metricsLen;
+static long long metricsDue;
 
-   dis=XOpenDisplay(NULL);
-   win=XCreateSimpleWindow(dis, DefaultRootWindow(dis), 1, 1, (int)(1024*sx), (int)(576*sy), 0, BlackPixel (dis, 0), BlackPixel(dis, 0));
-   XSetStandardProperties(dis, win, videoFile, videoFile, None, NULL, 0, NULL);
-   XSelectInput(dis, win, KeyPressMask | StructureNotifyMask | VisibilityChangeMask);
-   xhints(sx, sy);
-   wmDeleteMessage = XInternAtom(dis, "WM_DELETE_WINDOW", False);
-   XSetWMProtocols(dis, win, &wmDeleteMessage, 1); 
-   XMapWindow(dis, win);
-   XFlush(dis);
+static void metricsAdd(const char *fmt, ...) {
+   va_list ap;
+   int n;
 
-   return ConnectionNumber(dis);
+   va_start(ap, fmt);
+   n=vsnprintf(metricsBuf+metricsLen, sizeof(metricsBuf)-metricsLen, fmt, ap);
+   va_end(ap);
+   if (n > 0)
+      metricsLen+=((size_t)n < sizeof(metricsBuf)-metricsLen) ? (size_t)n : sizeof(metricsBuf)-metricsLen-1;
 }
 
-#ifdef XOMX_FB_DEV
-static int setScale(float *sx, float *sy) {
-   int fb_fd = 0;
-   struct fb_var_screeninfo fb_info;
+static void metricsWrite(void) {
+   char path[sizeof(metricsDir)+64], tmp[sizeof(metricsDir)+64];
+   unsigned int i;
+   double cpu=0;
+   long rss=0;
+   int up, fd;
 
-   fb_fd = open(XOMX_FB_DEV, O_RDONLY);
-   if (fb_fd == -1) {
-      fprintf(stderr, "setScale: Error opening %s; not setting scale factor.\n", XOMX_FB_DEV);
-      return 1;
+   metricsLen=0;
+   metricsAdd("# TYPE xomxplayer_commands_total counter\n");
+   for (i=0; i<LENGTH(cmdStats) && cmdStats[i].v!=NULL; i++)
+      metricsAdd("xomxplayer_commands_total{pid=\"%s\",method=\"%s\"} %lu\n", pid, cmdStats[i].name, cmdStats[i].count);
+   metricsAdd("# TYPE xomxplayer_command_seconds gauge\n");
+   for (i=0; i<LENGTH(cmdStats) && cmdStats[i].v!=NULL; i++) {
+      if (cmdStats[i].count==0)
+         continue;
+      metricsAdd("xomxplayer_command_seconds{pid=\"%s\",method=\"%s\",estimate=\"mean\"} %.6f\n", pid, cmdStats[i].name, cmdStats[i].ewma/1e6);
+      metricsAdd("xomxplayer_command_seconds{pid=\"%s\",method=\"%s\",estimate=\"p90\"} %.6f\n", pid, cmdStats[i].name, cmdStats[i].p90/1e6);
    }
-   if (ioctl(fb_fd, FBIOGET_VSCREENINFO, &fb_info)) {
-      printf("setScale: Error reading screen info; not setting scale factor.\n");
-      close(fb_fd);
-      return 1;
+   metricsAdd("# TYPE xomxplayer_spawns_total counter\nxomxplayer_spawns_total{pid=\"%s\"} %lu\n", pid, spawnCount);
+   metricsAdd("# TYPE xomxplayer_child_exits_total counter\n");
+   metricsAdd("xomxplayer_child_exits_total{pid=\"%s\",status=\"ok\"} %lu\n", pid, childExits[0]);
+   metricsAdd("xomxplayer_child_exits_total{pid=\"%s\",status=\"error\"} %lu\n", pid, childExits[1]);
+   metricsAdd("xomxplayer_child_exits_total{pid=\"%s\",status=\"signal\"} %lu\n", pid, childExits[2]);
+   metricsAdd("# TYPE xomxplayer_player_starts_total counter\nxomxplayer_player_starts_total{pid=\"%s\"} %lu\n", pid, playerStarts);
+   metricsAdd("# TYPE xomxplayer_player_kills_total counter\nxomxplayer_player_kills_total{pid=\"%s\"} %lu\n", pid, playerKills);
+   metricsAdd("# TYPE xomxplayer_move_events_total counter\nxomxplayer_move_events_total{pid=\"%s\"} %lu\n", pid, moveEvents);
+   metricsAdd("# TYPE xomxplayer_move_commands_total counter\nxomxplayer_move_commands_total{pid=\"%s\"} %lu\n", pid, moveCmds);
+   metricsAdd("# TYPE xomxplayer_moves_total counter\nxomxplayer_moves_total{pid=\"%s\"} %lu\n", pid, moves);
+   metricsAdd("# TYPE xomxplayer_visibility_events_total counter\nxomxplayer_visibility_events_total{pid=\"%s\"} %lu\n", pid, visEvents);
+   metricsAdd("# TYPE xomxplayer_visibility_commands_total counter\nxomxplayer_visibility_commands_total{pid=\"%s\"} %lu\n", pid, visCmds);
+   visibilityAccount();
+   metricsAdd("# TYPE xomxplayer_visibility_seconds_total counter\n");
+   metricsAdd("xomxplayer_visibility_seconds_total{pid=\"%s\",state=\"shown\"} %.3f\n", pid, visTime[0]/1e6);
+   metricsAdd("xomxplayer_visibility_seconds_total{pid=\"%s\",state=\"hidden\"} %.3f\n", pid, visTime[1]/1e6);
+   metricsAdd("# TYPE xomxplayer_staged_starts_total counter\n");
+   metricsAdd("xomxplayer_staged_starts_total{pid=\"%s\",result=\"hit\"} %u\n", pid, stageHits);
+   metricsAdd("xomxplayer_staged_starts_total{pid=\"%s\",result=\"miss\"} %u\n", pid, stageLaunches-stageHits);
+   if (schedFile[0]) {
+      metricsAdd("# TYPE xomxplayer_schedule_ticks_total counter\nxomxplayer_schedule_ticks_total{pid=\"%s\"} %lu\n", pid, schedTicks);
+      metricsAdd("# TYPE xomxplayer_schedule_seconds_total counter\nxomxplayer_schedule_seconds_total{pid=\"%s\"} %.6f\n", pid, schedUs/1e6);
+      metricsAdd("# TYPE xomxplayer_schedule_switches_total counter\nxomxplayer_schedule_switches_total{pid=\"%s\"} %lu\n", pid, schedSwitches);
+      metricsAdd("# TYPE xomxplayer_schedule_late_seconds gauge\nxomxplayer_schedule_late_seconds{pid=\"%s\"} %.3f\n", pid, schedLateUs/1e6);
+   }
+   metricsAdd("# TYPE xomxplayer_macros_total counter\nxomxplayer_macros_total{pid=\"%s\"} %lu\n", pid, macroRuns);
+   metricsAdd("# TYPE xomxplayer_macro_seconds_total counter\nxomxplayer_macro_seconds_total{pid=\"%s\"} %.3f\n", pid, macroUs/1e6);
+   if (wall!=NULL) {
+      metricsAdd("# TYPE xomxplayer_layout_switches_total counter\nxomxplayer_layout_switches_total{pid=\"%s\"} %lu\n", pid, layoutSwitches);
+      metricsAdd("# TYPE xomxplayer_layout_seconds_total counter\nxomxplayer_layout_seconds_total{pid=\"%s\"} %.3f\n", pid, layoutUs/1e6);
+   }
+   metricsAdd("# TYPE xomxplayer_session_writes_total counter\nxomxplayer_session_writes_total{pid=\"%s\"} %lu\n", pid, sessionWrites);
+   metricsAdd("# TYPE xomxplayer_audio_elided_total counter\nxomxplayer_audio_elided_total{pid=\"%s\"} %lu\n", pid, audioElided);
+   metricsAdd("# TYPE xomxplayer_audio_restored_total counter\nxomxplayer_audio_restored_total{pid=\"%s\"} %lu\n", pid, audioRestored);
+   up=(omxplayer_pid > 0 && playerUsage(omxplayer_pid, &cpu, &rss)==0);
+   metricsAdd("# TYPE xomxplayer_player_up gauge\nxomxplayer_player_up{pid=\"%s\"} %i\n", pid, up);
+   metricsAdd("# TYPE xomxplayer_player_cpu_seconds_total counter\n");
+   if (up)
+      metricsAdd("xomxplayer_player_cpu_seconds_total{pid=\"%s\",tile=\"0\",audio=\"%i\"} %.2f\n", pid, !audioOff, cpu);
+   for (i=1; i<(unsigned int)tileCount; i++) {   /* Mosaic tiles; audio="0" against audio="1" is what elision saves */
+      double tcpu=0;
+      long trss=0;
+
+      if (tiles[i].pid > 0 && playerUsage(tiles[i].pid, &tcpu, &trss)==0)
+         metricsAdd("xomxplayer_player_cpu_seconds_total{pid=\"%s\",tile=\"%u\",audio=\"%i\"} %.2f\n", pid, i, tiles[i].audio, tcpu);
+   }
+   metricsAdd("# TYPE xomxplayer_player_class gauge\n");
+   for (i=0; i<(unsigned int)((tileCount > 0) ? tileCount : 1); i++) {
+      if (prioPid[i] > 0 && prioApplied[i] >= 0)
+         metricsAdd("xomxplayer_player_class{pid=\"%s\",tile=\"%u\"} %i\n", pid, i, prioApplied[i]);
+   }
+   if (poolSize > 0) {
+      metricsAdd("# TYPE xomxplayer_pool_starts_total counter\nxomxplayer_pool_starts_total{pid=\"%s\"} %lu\n", pid, poolStarts);
+      metricsAdd("# TYPE xomxplayer_pool_claims_total counter\nxomxplayer_pool_claims_total{pid=\"%s\"} %lu\n", pid, poolClaims);
+      metricsAdd("# TYPE xomxplayer_pool_drops_total counter\nxomxplayer_pool_drops_total{pid=\"%s\"} %lu\n", pid, poolDrops);
+   }
+   metricsAdd("# TYPE xomxplayer_priority_changes_total counter\nxomxplayer_priority_changes_total{pid=\"%s\"} %lu\n", pid, prioChanges);
+   metricsAdd("# TYPE xomxplayer_player_run_delay_seconds_total counter\n");
+   for (i=0; i<LENGTH(prioClassDelay); i++)
+      metricsAdd("xomxplayer_player_run_delay_seconds_total{pid=\"%s\",class=\"%u\"} %.3f\n", pid, i, prioClassDelay[i]/1e9);
+   if (up)
+      metricsAdd("# TYPE xomxplayer_player_resident_bytes gauge\nxomxplayer_player_resident_bytes{pid=\"%s\"} %ld\n", pid, rss*1024);
+   metricsAdd("# EOF\n");
+
+   snprintf(path, sizeof(path), "%s/xomxplayer-%s.prom", metricsDir, pid);
+   snprintf(tmp, sizeof(tmp), "%s/.xomxplayer-%s.prom.tmp", metricsDir, pid);   /* Not *.prom: not collected */
+   if ((fd=open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644))==-1)
+      return;
+   if (write(fd, metricsBuf, metricsLen)==(ssize_t)metricsLen && close(fd)==0)
+      rename(tmp, path);
+   else {
+      close(fd);
+      unlink(tmp);
    }
-   *sx=(float)(fb_info.xres)/1920;
-   *sy=(float)(fb_info.yres)/1080;
-   close(fb_fd);
-   return 0;
 }
-#endif
+
+/* Remove the files of instances which died without cleaning up (crash, SIGKILL), so their last values aren't
+ * collected for ever
+ */
+static void metricsClean(void) {
+   struct dirent *e;
+   char path[sizeof(metricsDir)+300];
+   int n, p;
+   DIR *d;
+
+   if ((d=opendir(metricsDir))==NULL)
+      return;
+   while ((e=readdir(d))!=NULL) {
+      n=0;
+      if ((sscanf(e->d_name, "xomxplayer-%i.prom%n", &p, &n)==1 || sscanf(e->d_name, ".xomxplayer-%i.prom.tmp%n", &p, &n)==1) &&
+            n > 0 && e->d_name[n]=='\0' && p > 0 && kill(p, 0)==-1 && errno==ESRCH) {
+         snprintf(path, sizeof(path), "%s/%s", metricsDir, e->d_name);
+         unlink(path);
+      #ifdef DEBUG
+         fprintf(stderr, "Removed stale metrics %s.\n", path);
+      #endif
+      }
+   }
+   closedir(d);
+}
+
+/* Write the metrics if they are due. Returns microseconds until the next write, -1 if metrics are off */
+static long long metricsRun(void) {
+   long long t=nowUs();
+
+   if (metricsMs <= 0)
+      return -1;
+   if (t < metricsDue)
+      return metricsDue-t;
+   if (metricsDue==0)
+      metricsClean();
+   metricsWrite();
+   metricsDue=t+metricsMs*1000LL;
+   return metricsMs*1000LL;
+}
 
 int main(int argc, char *argv[]) {
-   int x11_fd;
+   /* volatile: kept across a longjmp from xioError() */
+   volatile int x11_fd;
    fd_set in_fds;
    struct timeval tv;
    XEvent ev;
-   int wx,wy;
-   unsigned int ww, wh;
-   long unsigned int evc=0;
-   pid_t omxplayer_pid;
+   volatile int wx=0, wy=0;
+   volatile unsigned int ww=0, wh=0;
+   int vx, vy;          /* Video rectangle sent to omxplayer */
+   unsigned int vw, vh;
+   volatile int moveHidden=0;    /* Video hidden for the current move / resize (hideOnMove) */
+   volatile long long gestureStart=0;
+   volatile long long lastEvent=0;  /* Last ConfigureNotify; the move has ended 500ms after it */
+   long long due;
+   volatile int gestureCmds=0;
+   volatile long unsigned int evc=0;
    pid_t chld_pid;
    int chld_status;
-   int omxplayerRunning=2;
+   volatile int omxplayerRunning=2;
    float sx=1.0;
    float sy=1.0;
    int i;
+   int retry;
+   char buf[64];
+   const char **timedCmds[]={ resize_player, hide_video, unhide_video, quit_player };
+   const XOMX_session *volatile restore=NULL;
+   long long restoreStart=nowUs();
+   double restorePos=0;
+   volatile int restorePaused=0;
+   int adoptFd=-1;
+   struct sigaction sa={ .sa_handler=upgradeSignal };
+   char *prog=argv[0];
+   volatile int schedFd=-1;
+   XOMX_sched *sched;
+   unsigned long long ticks;
+   int ready, jumped;
+   int layoutOwn;
+   int mosaic=0;
+   pid_t p;
 
-   if (argc!=2) {
-      printf("Usage: %s <video file>\n", argv[0]);
+   if (argc>=3 && !strcmp(argv[1], "-i"))
+      return indexLibrary(argv+2, argc-2);
+   if (argc>=2 && !strcmp(argv[1], "--export-log"))
+      return playLogExport(argc>=3 && !strcmp(argv[2], "--json"));
+   if (argc==3 && !strcmp(argv[1], "--layout"))
+      return layoutCommand(atoi(argv[2]));
+   if (argc>=3 && !strcmp(argv[1], "--slot")) {
+      layoutSlot=atoi(argv[2]);
+      if (layoutSlot < 0 || layoutSlot >= (int)LENGTH(layouts[0])) {
+         fprintf(stderr, "Slot %i: there are %i.\n", layoutSlot, (int)LENGTH(layouts[0]));
+         return 1;
+      }
+      argv+=2;
+      argc-=2;
+   }
+   if (argc>=3 && !strcmp(argv[1], "--schedule")) {
+      snprintf(schedFile, sizeof(schedFile), "%s", argv[2]);
+      argv+=2;
+      argc-=2;
+   }
+   if (argc>=3 && !strcmp(argv[1], "-m")) {
+      mosaic=1;
+      argv++;
+      argc--;
+   }
+   if (argc==3 && !strcmp(argv[1], "--adopt"))
+      adoptFd=atoi(argv[2]);   /* The session file is opened for the handed over slot, see adopt() */
+   else {
+      sessionOpen(layoutSlot);
+      if (argc>=2 && !strcmp(argv[1], "--restore")) {
+         argv++;
+         argc--;
+         if ((restore=sessionRestore())==NULL)
+            fprintf(stderr, "No session to restore.\n");
+      }
+   }
+   if (argc<2 && restore==NULL && !schedFile[0]) {
+      printf("Usage: %s [--slot <n>] [--schedule <file>] [-m] [--restore] <video file>...\n       %s [--slot <n>] [--schedule <file>] --restore\n"
+         "       %s -i <library dir>...\n       %s --export-log [--json]\n       %s --layout <n>\n", prog, prog, prog, prog, prog);
       return 1;
    }
+   if (schedFile[0] && adoptFd==-1) {
+      if (schedLoad(schedFile))
+         return 1;
+      schedBase=schedAnchor(time(NULL));
+   }
+   if (restore==NULL && adoptFd==-1) {
+      if (schedBase!=NULL) {   /* The loop due now, rather than the command line files */
+         schedCur=schedBase;
+         playlist=schedBase->files;
+         playlistLen=schedBase->nfiles;
+      }
+      else if (mosaic) {   /* Tile 0 plays the first */
+         playlist=argv+1;
+         playlistLen=1;
+         mosaicInit(argv+2, argc-2);
+      }
+      else if (argc >= 2) {
+         playlist=argv+1;
+         playlistLen=argc-1;
+      }
+      else {
+         fprintf(stderr, "Schedule: nothing to play now.\n");
+         return 1;
+      }
+   }
 #ifdef XOMX_FB_DEV
    setScale(&sx, &sy);
 #endif
    printf("Scale factor=(%f,%f)\n",sx, sy);
 
-   x11_fd=initX(argv[1], sx, sy);
+   stageStart();
+   playLogStart();
+   if (adoptFd!=-1 && (omxplayerRunning=adopt(adoptFd))==0) {   /* Start afresh from the session snapshot */
+      fprintf(stderr, "Upgrade: nothing to adopt, restoring the session.\n");
+      adoptFd=-1;
+      omxplayerRunning=2;
+      if (session==NULL)
+         sessionOpen(layoutSlot);
+      if ((restore=sessionRestore())==NULL) {
+         fprintf(stderr, "No session to restore.\n");
+         return 1;
+      }
+   }
+   if (adoptFd!=-1) {   /* Started by upgrade() */
+      wx=handover.wx;
+      wy=handover.wy;
+      ww=handover.ww;
+      wh=handover.wh;
+   }
+   else {
+      loadItem(restore ? restore->item : 0);
+      visSince=nowUs();
+   }
+   sessionPlaylist();
+   if (adoptFd!=-1)
+      initNames();
+   else if (restore) {   /* Start omxplayer where it was, while the window is being created */
+      snprintf(layerParam, sizeof(layerParam), "%.15s", restore->layer);
+      initNames();
+      restorePos=restore->pos+((restoreFollowClock && !restore->paused) ? (realUs()-restore->anchor)/1e6 : 0);
+      if (restorePos < 0 || (probe.duration > 0 && restorePos >= probe.duration))
+         restorePos=0;   /* Past the end of the item (with restoreFollowClock, down for longer than its rest) */
+      restorePaused=restore->paused;
+      videoHidden=restore->hidden;
+      geom.x=restore->frameX;
+      geom.y=restore->frameY;
+      geom.w=restore->w;
+      geom.h=restore->h;
+      geomGiven=1;
+      wx=restore->x/sx;
+      wy=restore->y/sy;
+      ww=restore->w/sx;
+      wh=restore->h/sy;
+      vx=wx;
+      vy=wy;
+      vw=ww;
+      vh=wh;
+#ifdef XOMX_SNAP
+      snapRect(&vx, &vy, &vw, &vh);
+#endif
+      snprintf(winParam,30,"%i %i %i %i", vx, vy, vx+vw, vy+vh);
+      startPlayer(restorePos);
+      omxplayerRunning=(omxplayer_pid < 1) ? 0 : 1;
+   }
+   else
+      initNames();
+   if (tileCount > 0 && adoptFd==-1)
+      mosaicNames();
+   poolNames();
+   if ((x11_fd=(adoptFd!=-1) ? adoptX(sx, sy, handover.win) : initX(sx, sy))==-1) {
+      fprintf(stderr, "Can't open display.\n");
+      if (omxplayer_pid < 1)
+         return 1;
+      xDetach();   /* Restored or adopted omxplayer plays on; the window comes when a display does */
+   }
+   else if (adoptFd==-1)
+      showPoster();
+   else if (win!=handover.win && omxplayer_pid > 0) {   /* Made again: move the overlay to it */
+      snprintf(resizeParam, sizeof(resizeParam), "string:%s", winParam);
+      spawn(resize_player);
+   }
+   if (adoptFd!=-1) {
+      tuneLog("upgrade pid=%i handover %lli ms\n", omxplayer_pid, (nowUs()-handover.start)/1000);
+      fprintf(stderr, "Upgraded: omxplayer %i adopted, %lli ms handover.\n", omxplayer_pid, (nowUs()-handover.start)/1000);
+   }
+   sigaction(SIGUSR2, &sa, NULL);   /* No SA_RESTART: select() returns to handle it */
+   if (layoutSlot >= 0) {
+      if ((wall=wallOpen())==NULL)
+         fprintf(stderr, "Layout: no wall in /dev/shm (%s).\n", strerror(errno));
+      else {
+         wall->start[layoutSlot]=pidStart(getpid());
+         wall->pid[layoutSlot]=getpid();
+         sa.sa_handler=layoutSignal;
+         sigaction(SIGUSR1, &sa, NULL);
+      }
+   }
+   if (adoptFd==-1 && restore==NULL)
+      audioOff=(layoutSlot >= 0 && layoutSlot!=wallAudioSlot);   /* Not heard: start without audio */
+   if (schedFile[0] && (schedFd=schedTimer())==-1)
+      fprintf(stderr, "Schedule: no timerfd.\n");
+   if (overrideRedirect && restore==NULL && adoptFd==-1) {  /* No ConfigureNotify from a window manager: start at the created geometry */
+      wx=1/sx;
+      wy=1/sy;
+      ww=1024;
+      wh=576;
+      evc=1;
+   }
+   loadCmdStats(timedCmds, LENGTH(timedCmds));
+   for (i=0; i<LENGTH(keys); i++) {
+      if (keys[i].v!=NULL)
+         cmdStat(keys[i].v);
+   }
 
    while(omxplayerRunning > 0) {
+      if (setjmp(xLost)) {   /* X server gone */
+         xDetach();
+         x11_fd=-1;
+         if (omxplayerRunning==2) {   /* Still waiting for win to be placed: start at its last geometry */
+            wx=geom.x/sx;
+            wy=geom.y/sy;
+            ww=geom.w/sx;
+            wh=geom.h/sy;
+            evc=1;
+            lastEvent=0;
+         }
+         else if (omxplayerRunning==1 && omxplayer_pid < 1 && tileCount==0) {   /* Lost between items: play on */
+            startPlayer(0);
+            if (omxplayer_pid < 1)
+               omxplayerRunning=0;
+         }
+         continue;
+      }
+      xLostSet=1;
+      if (upgradeWanted && !audioPending()) {   /* Not with a player part way through a restart or switch */
+         upgradeWanted=0;
+         handover.running=omxplayerRunning;
+         handover.wx=wx;
+         handover.wy=wy;
+         handover.ww=ww;
+         handover.wh=wh;
+         upgrade(&handover, prog);
+      }
+      if (layoutWanted)
+         layoutApply(sx, sy);
+      if (dis==NULL && nowUs() >= xRetryAt)
+         x11_fd=xReattach(sx, sy);
       FD_ZERO(&in_fds);
-      FD_SET(x11_fd, &in_fds);
+      if (x11_fd!=-1)
+         FD_SET(x11_fd, &in_fds);
+      if (schedFd!=-1)
+         FD_SET(schedFd, &in_fds);
 
       tv.tv_usec = 500000;
       tv.tv_sec = 0;
+      if (evc>0 && omxplayerRunning==1 && (retry=cmdWait(resize_player)) > 0 && retry < 500000)
+         tv.tv_usec = retry;  /* Waiting to send a VideoPos */
+      retry=0;
+      if (evc>0 && (due=500000-(nowUs()-lastEvent)) > 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* Rest of the 500ms after the last event */
+      if ((due=visibilityRun(moveHidden || layoutHidden)) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* Visibility change due */
+      if ((due=macroRun()) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* Next macro step */
+      if ((due=keysRun()) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* Queued key */
+      if ((due=chainRun()) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* Command of a move to be reaped */
+      if ((due=layoutRun()) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* Waiting for the other slots of the wall */
+      if ((due=audioRun()) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* A player is due to be restarted, or killed */
+      if ((due=replaceRun()) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* omxplayer being replaced is due to be killed */
+      if ((due=prioRun()) < tv.tv_usec)
+         tv.tv_usec = due;    /* Priority change or sample due */
+      if ((due=poolRun()) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* Warm player to start or pause */
+      if ((due=metricsRun()) >= 0 && due < tv.tv_usec)
+         tv.tv_usec = due;    /* Metrics due */
+      if (dis==NULL && (due=xRetryAt-nowUs()) < tv.tv_usec)
+         tv.tv_usec = (due > 0) ? due : 0;    /* Reconnect attempt due */
       
-      switch (select(x11_fd+1, &in_fds, 0, 0, &tv)) {
+      switch ((ready=select(((x11_fd > schedFd) ? x11_fd : schedFd)+1, &in_fds, 0, 0, &tv))) {
       case 0: /* Timed out waiting for xevents */
-         if (evc>0) {
-            snprintf(winParam,30,"%i %i %i %i", wx, wy, wx+ww, wy+wh);
+         visibilityRun(moveHidden || layoutHidden);
+         layoutRun();
+         audioRun();
+         replaceRun();
+         prioRun();
+         poolRun();
+         if (evc>0 && nowUs()-lastEvent < 500000)
+            retry=1;   /* Woken early for something else; the move hasn't finished */
+         else if (evc>0) {
+            layoutGeom.w=0;   /* Moved since the layout switch */
+            vx=wx;
+            vy=wy;
+            vw=ww;
+            vh=wh;
+#ifdef XOMX_SNAP
+            snapRect(&vx, &vy, &vw, &vh);
+#endif
+            snprintf(winParam,30,"%i %i %i %i", vx, vy, vx+vw, vy+vh);
+            if (tileCount > 0)   /* Every tile's rectangle */
+               mosaicLayout(wx, wy, ww, wh, 0);
             if (omxplayerRunning==2) { /* omxplayer has not been started yet */
-               omxplayer_pid=spawn(omxplayer);
+               startPlayer(0);
+               mosaicStart();
                if (omxplayer_pid < 1)
                   omxplayerRunning=0; /* Failed */
                else
                   omxplayerRunning=1;
             }
+            else if (tileCount > 0) {   /* One pass over the grid, every VideoPos at once */
+               p=mosaicLayout(wx, wy, ww, wh, 1);
+               gestureCmds+=tileCount;
+               if (moveHidden) {
+                  if (!videoHidden)
+                     chainAdd(unhide_video, p);   /* Once tile 0 has moved */
+                  gestureCmds+=tileCount;
+                  moveHidden=0;
+               }
+               moves++;
+               moveEvents+=evc;
+               moveCmds+=gestureCmds;
+            }
             else {   /* omxplayer is running */
+               if (renditionSwitch && switchRendition(vw, vh)) {
+                  evc=0;   /* Restarted at the new size, not hidden */
+                  moveHidden=0;
+                  break;
+               }
                strncpy(resizeParam, "string:",10);
                strncat(resizeParam, winParam, 30);
-               spawn(resize_player);
+               if (moveHidden) {  /* Move while hidden, then show at the new position, after the hide */
+                  chainAdd(resize_player, 0);
+                  if (!videoHidden)
+                     chainAdd(unhide_video, 0);
+                  gestureCmds+=2;
+                  moveHidden=0;
+               }
+               else if (cmdWait(resize_player) > 0)
+                  retry=1;  /* omxplayer hasn't finished the last VideoPos; send this one when it can take it */
+               else {
+                  spawn(resize_player);
+                  gestureCmds++;
+               }
+               if (!retry) {
+                  moves++;
+                  moveEvents+=evc;
+                  moveCmds+=gestureCmds;
+               }
+            #ifdef DEBUG
+               if (!retry)
+                  fprintf(stderr, "Move: %lu events, %i commands, settled in %lli ms (%s).\n", evc, gestureCmds,
+                  (nowUs()-gestureStart)/1000, hideOnMove ? "hide while moving" : "live tracking");
+            #endif
+            }
+         }
+         if (!retry)
+            evc=0;   /* Reset resize event counter */
+         if (!playerReady && omxplayerRunning==1 && omxplayer_pid > 0 && queryPosition() >= 0) {   /* omxplayer is up */
+            playerReady=1;
+            playAnchor=realUs();   /* Playing from now, not from the spawn */
+            if (schedDue) {   /* Switch accuracy: due time to playing */
+               schedLateUs=realUs()-schedDue;
+               tuneLog("schedule %s playing %lli ms after due\n", sourceFile, schedLateUs/1000);
+               schedDue=0;
+            }
+            for (i=0, buf[0]='\0'; playerArgs[i]!=NULL; i++) {   /* Options which vary per file, for comparing start times */
+               if (!strcmp(playerArgs[i], "--font") || !strcmp(playerArgs[i], "--no-osd"))
+                  snprintf(buf+strlen(buf), sizeof(buf)-strlen(buf), "%s%s", buf[0] ? "," : "", playerArgs[i]);
+            }
+            tuneLog("ready %s %lli ms options=%s\n", sourceFile, (nowUs()-playerStart)/1000, buf[0] ? buf : "none");
+         #ifdef DEBUG
+            fprintf(stderr, "omxplayer ready %lli ms after start (%s).\n", (nowUs()-playerStart)/1000, buf);
+         #endif
+            if (posterShown)
+               hidePoster();
+            if (videoHidden)
+               spawn(hide_video);   /* Obscured while omxplayer was starting */
+            if (restorePaused) {
+               spawn(pause_player);
+               playMark(0, 1);
+               restorePaused=0;
+            }
+            if (restore) {
+               tuneLog("restored %s at %.1fs in %lli ms\n", sourceFile, restorePos, (nowUs()-restoreStart)/1000);
+            #ifdef DEBUG
+               fprintf(stderr, "Session restored in %lli ms.\n", (nowUs()-restoreStart)/1000);
+            #endif
+               restore=NULL;
             }
          }
-         evc=0;   /* Reset resize event counter */
-         chld_pid=waitpid(-1, &chld_status, WNOHANG);
-         if (chld_pid>0) {
+         while ((chld_pid=waitpid(-1, &chld_status, WNOHANG)) > 0) {
+            cmdDone(chld_pid);
+            audioReaped(chld_pid);
+            if (replaceReaped(chld_pid, chld_status) && (tileCount==0 || mosaicLeft()==0))
+               omxplayerRunning=0;   /* omxplayer couldn't be started again */
+            macroReaped(chld_pid);
+            chainReaped(chld_pid);
+            layoutReaped(chld_pid);
+            mosaicReaped(chld_pid);
+            poolReaped(chld_pid, chld_status);
+            childExited(chld_status);
          #ifdef DEBUG
             if (WIFEXITED(chld_status))
                fprintf(stderr, "Child with pid %i finished with exit code %i.\n",chld_pid, WEXITSTATUS(chld_status));
          #endif
             if (omxplayerRunning==1 && chld_pid==omxplayer_pid) {
-               omxplayerRunning=0;  /* omxplayer finished */
+               playLogged(playEnded, WIFEXITED(chld_status) ? WEXITSTATUS(chld_status) : -WTERMSIG(chld_status));
+               if (autoBuffer && probe.duration > 0)  /* Playing time well over the duration suggests underruns */
+                  tuneLog("end %s status=%i played=%.1fs duration=%.1fs\n", sourceFile, WIFEXITED(chld_status) ? WEXITSTATUS(chld_status) : -1,
+                     (nowUs()-playerStart)/1e6, probe.duration);
                omxplayer_pid=0;
+               if (playlistCur+1 < playlistLen) {   /* Next file, same window */
+                  loadItem(playlistCur+1);
+                  if (!poolClaim()) {
+                     startPlayer(0);   /* Before X, which may be lost */
+                     if (dis!=NULL)
+                        showPoster();
+                  }
+                  if (dis!=NULL)
+                     XStoreName(dis, win, sourceFile);
+                  if (omxplayer_pid < 1)
+                     omxplayerRunning=0;
+               }
+               else if (schedFd!=-1) {   /* Loop, or go back to the loop a break interrupted */
+                  poolSwitch((schedCur!=NULL && schedCur->every > 0) ? schedBase : NULL);
+                  if (omxplayer_pid < 1)
+                     omxplayerRunning=0;
+               }
+               else if (mosaicLeft() > 0) {   /* The other tiles play on */
+                  if (tileFocus==0)
+                     mosaicFocus();
+               }
+               else
+                  omxplayerRunning=0;  /* omxplayer finished */
             }
+            else if (omxplayerRunning==1 && omxplayer_pid==0 && tileCount > 0 && mosaicLeft()==0)
+               omxplayerRunning=0;  /* The last tile finished */
          }
       break;
       case -1: /* Error occured or signal received */
+         if (errno==EINTR && (upgradeWanted || layoutWanted))
+            break;   /* Upgrade or layout switch, at the top of the loop */
          if (omxplayerRunning==1) {
             spawn(quit_player);
             omxplayerRunning=0;
@@ -303,12 +5581,29 @@ int main(int argc, char *argv[]) {
       break;
       }
 
+      if (ready > 0 && schedFd!=-1 && FD_ISSET(schedFd, &in_fds)) {   /* Schedule tick */
+         jumped=(read(schedFd, &ticks, sizeof(ticks))==-1 && errno==ECANCELED);
+         if (jumped)
+            schedTimer();   /* Re-arm from the new time */
+         if ((sched=schedRun(time(NULL), jumped))!=NULL) {
+            if (omxplayerRunning==1)
+               poolSwitch(sched);
+            else
+               schedSwitch(sched, 0);
+            if (omxplayerRunning==1 && omxplayer_pid < 1)
+               omxplayerRunning=0;
+         }
+      }
+
       /* Handle XEvents and flush the input */
-      while(XPending(dis)) {
+      while(dis!=NULL && XPending(dis)) {
          XNextEvent(dis, &ev);
          switch (ev.type) {
          case KeyPress:
-            omxplayerRunning=keypress(&ev);
+            if (wall!=NULL && XLookupKeysym(&ev.xkey, 0)==layoutKey)
+               layoutBegin(wall, (wallPreset(wall)+1)%LENGTH(layouts));
+            else
+               omxplayerRunning=keypress(&ev);
          break;
          case ClientMessage:
             if (ev.xclient.data.l[0] == wmDeleteMessage) {
@@ -317,54 +5612,78 @@ int main(int argc, char *argv[]) {
             }
          break;
          case ConfigureNotify:
-            if (ev.xconfigure.x>=0 && ev.xconfigure.y>=0) {
-               ww=ev.xconfigure.width/sx;
-               wh=ev.xconfigure.height/sy;
-               wx=ev.xconfigure.x/sx;
-               wy=ev.xconfigure.y/sy;
-               evc++;
+         case ReparentNotify:
+         case PropertyNotify:
+            if (trackGeometry(&ev) && geom.x>=0 && geom.y>=0) {
+               layoutOwn=(omxplayer_pid > 0 && layoutMoved());   /* Where a layout switch put it, VideoPos sent */
+               if (evc==0 && !layoutOwn) {  /* First event of a move / resize */
+                  gestureStart=nowUs();
+                  gestureCmds=0;
+                  if (hideOnMove && omxplayerRunning==1 && !videoHidden && !moveHidden) {
+                     chainAdd(hide_video, 0);
+                     gestureCmds++;
+                     moveHidden=1;
+                  }
+               }
+               if (geom.w!=(int)(ww*sx+0.5) || geom.h!=(int)(wh*sy+0.5)) {
+                  setOpaqueRegion(geom.w, geom.h);
+                  if (posterShown)
+                     showPoster();
+               }
+               ww=geom.w/sx;
+               wh=geom.h/sy;
+               wx=geom.x/sx;
+               wy=geom.y/sy;
+               if (layoutOwn)
+                  evc=0;
+               else {
+                  evc++;
+                  lastEvent=nowUs();
+               }
             }
          break;
+         case Expose:
+            if (posterShown && ev.xexpose.count==0)
+               drawPoster();
+         break;
          case VisibilityNotify:
             if (ev.xvisibility.state==VisibilityFullyObscured)
-               spawn(hide_video);
+               visibilityChanged(1);
             else if (ev.xvisibility.state==VisibilityUnobscured)
-               spawn(unhide_video);
+               visibilityChanged(0);
          break;
          }
       }
+      sessionSave();
    }
 
-   if (omxplayer_pid != 0) {
-      i=0;
-      while (i<3) {  /* Wait for omxplayer to finish */
-         chld_pid=waitpid(omxplayer_pid, &chld_status, WNOHANG);
-         if (chld_pid > 0)
-            break;
-         else
-            sleep(1);
-         i++;
-      }
-
-      if (chld_pid != omxplayer_pid) { /* Looks like omxplayer is not responding to dbus control, send TERM signal */
-         fprintf(stderr, "ERROR: xomxplayer: omxplayer not responding, sending SIGTERM.\n");
-         kill(omxplayer_pid, SIGTERM);
-         sleep(1);
-         chld_pid=waitpid(omxplayer_pid, &chld_status, WNOHANG);
-         if (chld_pid != omxplayer_pid) {/* SIGTERM ignored, try SIGKILL */
-            fprintf(stderr, "ERROR: xomxplayer: SIGTERM ignored, sending SIGKILL.\n");
-            kill(omxplayer_pid, SIGKILL);
-            sleep(1);
-            chld_pid=waitpid(omxplayer_pid, &chld_status, WNOHANG);
-            if (chld_pid != omxplayer_pid)
-               fprintf(stderr, "ERROR: xomxplayer: Can't stop omxplayer!\n");
-         }
-      }
-   }
+   if (omxplayer_pid != 0)
+      stopPlayer();
    else
       fprintf(stderr, "ERROR: xomxplayer stopped unexpectedly.\n");
+   if (tileCount > 0)
+      mosaicStop();
+   poolDrop(1);
+
+#ifdef DEBUG
+   fprintf(stderr, "Session: %lu snapshots written.\n", sessionWrites);
+   if (nowUs() > visSince)
+      fprintf(stderr, "Visibility: %lu commands sent for %lu changes, %.0f saved per hour.\n", visCmds, visEvents,
+         (visEvents-visCmds)*3600e6/(nowUs()-visSince));
+#endif
+   saveCmdStats();
+   playLogStop();
+   if (wall!=NULL && wall->pid[layoutSlot]==getpid())
+      wall->pid[layoutSlot]=0;
+   if (metricsMs > 0) {   /* Gone with the process */
+      char path[sizeof(metricsDir)+64];
 
-   XDestroyWindow(dis,win);
-   XCloseDisplay(dis);
+      snprintf(path, sizeof(path), "%s/xomxplayer-%s.prom", metricsDir, pid);
+      unlink(path);
+   }
+   if (dis!=NULL) {
+      XDestroyWindow(dis,win);
+      XCloseDisplay(dis);
+   }
    return 0;
 }